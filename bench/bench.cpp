@@ -0,0 +1,320 @@
+#include "resize.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+namespace po = boost::program_options;
+
+struct bench_config
+{
+    std::string format;
+    cv::Size size;
+    int threads;
+    std::string interpolation;
+    std::string target;
+    bool generic_resize;
+    bool coef_cache;
+    std::string parallelism;
+};
+
+/**
+ * @brief Fills an image with gradients, stripes and noise, so encoders see
+ * something closer to a photo than a flat color
+ */
+static void fill_synthetic(cv::Mat &image, uint32_t seed)
+{
+    for (int y = 0; y < image.rows; y++)
+    {
+        uchar *row = image.ptr<uchar>(y);
+        for (int x = 0; x < image.cols; x++)
+        {
+            seed = seed * 1664525u + 1013904223u; // LCG, deterministic across runs
+            int noise = (seed >> 24) & 0x1F;
+            row[x * 3 + 0] = static_cast<uchar>((x * 255 / image.cols + noise) & 0xFF);
+            row[x * 3 + 1] = static_cast<uchar>((y * 255 / image.rows + noise) & 0xFF);
+            row[x * 3 + 2] = static_cast<uchar>((((x / 32) ^ (y / 32)) & 1) ? 200 - noise : 55 + noise);
+        }
+    }
+}
+
+/**
+ * @brief Writes the synthetic images of one format and size, files already
+ * generated by a previous run are reused
+ */
+static std::vector<std::string> generate_corpus(const std::string &dir, const std::string &format, cv::Size size, int count)
+{
+    std::vector<std::string> paths;
+    cv::Mat image(size, CV_8UC3);
+
+    boost::filesystem::create_directories(dir);
+    for (int i = 0; i < count; i++)
+    {
+        std::string path = dir + "/" + std::to_string(size.width) + "x" + std::to_string(size.height) + "_" + std::to_string(i) + "." + format;
+        if (!boost::filesystem::exists(path))
+        {
+            fill_synthetic(image, i + 1);
+            if (!cv::imwrite(path, image))
+                throw std::runtime_error("Failed to write " + path);
+        }
+        paths.push_back(path);
+    }
+    return paths;
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(sorted.size() * p));
+    return sorted[index];
+}
+
+/**
+ * @brief Runs one configuration over a corpus and prints a JSON line
+ */
+static std::string run_config(const bench_config &config, const std::vector<std::string> &paths, resize_opts opts)
+{
+    scheduler sched(config.threads);
+    std::vector<std::vector<double>> latencies(config.threads);
+
+    for (auto &path : paths)
+        sched.push({path, nullptr});
+    sched.close();
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    parallelism_init(opts, sched);
+    memory_budget_init(opts);
+    for (int i = 0; i < config.threads; i++)
+    {
+        threads.push_back(std::thread([&, i] {
+            task t;
+            while (sched.pop(i, t))
+            {
+                auto image_start = std::chrono::steady_clock::now();
+                if (!process_image(opts, t))
+                {
+                    sched.defer(std::move(t));
+                    continue;
+                }
+                latencies[i].push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - image_start).count());
+            }
+        }));
+        if (opts.pin_threads)
+            pin_thread(threads.back(), i);
+    }
+    for (auto &thread : threads)
+        thread.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // outputs are written next to the corpus, remove them for the next run
+    for (auto &path : paths)
+        std::remove(make_output_path(opts, path).c_str());
+
+    std::vector<double> all;
+    for (auto &worker : latencies)
+        all.insert(all.end(), worker.begin(), worker.end());
+    std::sort(all.begin(), all.end());
+
+    double megapixels = static_cast<double>(config.size.area()) * paths.size() / 1e6;
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(3)
+         << "{\"format\": \"" << config.format << "\""
+         << ", \"size\": \"" << config.size.width << "x" << config.size.height << "\""
+         << ", \"images\": " << paths.size()
+         << ", \"threads\": " << config.threads
+         << ", \"interpolation\": \"" << config.interpolation << "\""
+         << ", \"target\": \"" << config.target << "\""
+         << ", \"parallelism\": \"" << config.parallelism << "\""
+         << ", \"generic_resize\": " << (config.generic_resize ? "true" : "false")
+         << ", \"coef_cache\": " << (config.coef_cache ? "true" : "false")
+         << ", \"seconds\": " << seconds
+         << ", \"images_per_s\": " << paths.size() / seconds
+         << ", \"megapixels_per_s\": " << megapixels / seconds
+         << ", \"p50_ms\": " << percentile(all, 0.50)
+         << ", \"p99_ms\": " << percentile(all, 0.99)
+         << "}";
+    return json.str();
+}
+
+/**
+ * @brief Times box_downscale against cv::resize(INTER_AREA) on one image,
+ * in memory, and counts the samples where they differ
+ */
+static std::string run_area_kernels(cv::Size size, int factor, int repeats, size_t &mismatches)
+{
+    cv::Mat src(size, CV_8UC3);
+    cv::Mat box, generic;
+    int width = size.width / factor;
+    int height = size.height / factor;
+    fill_synthetic(src, factor);
+    if (!box_downscale_supported(src, width, height))
+        throw std::runtime_error("No box kernel for a " + std::to_string(factor) + "x downscale of this size");
+
+    auto time = [&](const std::function<void()> &resize) {
+        std::vector<double> durations;
+        for (int i = 0; i < repeats; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            resize();
+            durations.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::sort(durations.begin(), durations.end());
+        return percentile(durations, 0.50);
+    };
+    double box_ms = time([&] { box_downscale(src, box, width, height); });
+    double generic_ms = time([&] { cv::resize(src, generic, cv::Size(width, height), 0, 0, cv::INTER_AREA); });
+
+    mismatches = 0;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width * 3; x++)
+            mismatches += box.ptr<uchar>(y)[x] != generic.ptr<uchar>(y)[x];
+    }
+
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(3)
+         << "{\"size\": \"" << size.width << "x" << size.height << "\""
+         << ", \"factor\": " << factor
+         << ", \"kernel\": \"" << box_downscale_kernel() << "\""
+         << ", \"box_ms\": " << box_ms
+         << ", \"opencv_ms\": " << generic_ms
+         << ", \"mismatches\": " << mismatches
+         << "}";
+    return json.str();
+}
+
+static std::vector<std::string> split_list(const std::string &list)
+{
+    std::vector<std::string> items;
+    boost::split(items, list, boost::is_any_of(" "), boost::token_compress_on);
+    items.erase(std::remove(items.begin(), items.end(), ""), items.end());
+    return items;
+}
+
+int main(int argc, char **argv)
+{
+    std::string default_threads;
+    for (unsigned int i = 1; i <= std::thread::hardware_concurrency(); i *= 2)
+        default_threads += std::to_string(i) + " ";
+
+    po::options_description desc("Usage: " + std::string(argv[0]) + " [OPTION]...");
+    desc.add_options()
+        ("help", "print this help message and exit")
+        ("corpus_dir", po::value<std::string>()->default_value("bench_corpus"), "directory the synthetic images are generated in")
+        ("formats", po::value<std::string>()->default_value("jpg png webp"), "formats to generate (space separated)")
+        ("sizes", po::value<std::string>()->default_value("640x480 1920x1080 4000x3000"), "source sizes to generate, as WxH (space separated)")
+        ("count", po::value<int>()->default_value(32), "images per format and size")
+        ("threads", po::value<std::string>()->default_value(default_threads), "thread counts to sweep (space separated)")
+        ("interpolations", po::value<std::string>()->default_value("area linear cubic"), "downscale interpolations to sweep (space separated)")
+        ("targets", po::value<std::string>()->default_value("scale:0.5 512x512 256x min:320x320"), "targets to sweep, as scale:F, WxH, Wx, xH or min:WxH (space separated)")
+        ("parallelism", po::value<std::string>()->default_value("auto"), "parallelism policies to sweep, auto, inter or intra (space separated)")
+        ("pin_threads", po::bool_switch()->default_value(false), "pin each worker thread to a CPU")
+        ("generic_resize", po::bool_switch()->default_value(false), "resize with OpenCV, even exact integer INTER_AREA downscales")
+        ("coef_cache", po::bool_switch()->default_value(false), "resize with the separable resampler and its coefficient cache")
+        ("area_kernels", po::bool_switch()->default_value(false), "only time the box filter against cv::resize(INTER_AREA) in memory, and count differing samples")
+        ("factors", po::value<std::string>()->default_value("3 4 8"), "downscale factors of --area_kernels (space separated)")
+        ("output", po::value<std::string>(), "also append the JSON lines to this file")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } catch (po::error &e) {
+        std::cerr << "Failed to parse command line: " << e.what() << std::endl;
+        return (1);
+    }
+    if (vm.count("help"))
+    {
+        std::cout << desc << std::endl;
+        return (0);
+    }
+
+    std::ofstream output;
+    if (vm.count("output"))
+        output.open(vm["output"].as<std::string>(), std::ios::app);
+
+    try {
+        if (vm["area_kernels"].as<bool>())
+        {
+            bool exact = true;
+            for (auto &size_str : split_list(vm["sizes"].as<std::string>()))
+            {
+                target_spec size = parse_target_spec(size_str);
+                if (size.method != RESIZE_METHOD::HEIGHT_WIDTH)
+                    throw std::runtime_error("Invalid size " + size_str + ", expected WxH");
+                for (auto &factor : split_list(vm["factors"].as<std::string>()))
+                {
+                    size_t mismatches;
+                    std::string line = run_area_kernels(cv::Size(size.width, size.height), std::stoi(factor), vm["count"].as<int>(), mismatches);
+                    exact = exact && mismatches == 0;
+                    std::cout << line << std::endl;
+                    if (output)
+                        output << line << std::endl;
+                }
+            }
+            return exact ? 0 : 1;
+        }
+        for (auto &format : split_list(vm["formats"].as<std::string>()))
+        {
+            for (auto &size_str : split_list(vm["sizes"].as<std::string>()))
+            {
+                target_spec size = parse_target_spec(size_str);
+                if (size.method != RESIZE_METHOD::HEIGHT_WIDTH)
+                    throw std::runtime_error("Invalid size " + size_str + ", expected WxH");
+                bench_config config;
+                config.format = format;
+                config.size = cv::Size(size.width, size.height);
+                std::vector<std::string> paths = generate_corpus(vm["corpus_dir"].as<std::string>(), format, config.size, vm["count"].as<int>());
+
+                for (auto &threads : split_list(vm["threads"].as<std::string>()))
+                {
+                    for (auto &interpolation : split_list(vm["interpolations"].as<std::string>()))
+                    {
+                        for (auto &policy : split_list(vm["parallelism"].as<std::string>()))
+                        {
+                            for (auto &target_str : split_list(vm["targets"].as<std::string>()))
+                            {
+                                resize_opts opts = default_options();
+                                target_spec target = parse_target_spec(target_str);
+                                opts.keep = true;
+                                opts.suffix = "_bench";
+                                opts.progress = false;
+                                opts.delete_fails = false; // never touch the corpus
+                                opts.threads = std::stoi(threads);
+                                opts.down_interpolation = find_interpolation(interpolation);
+                                opts.method = target.method;
+                                opts.scale = target.scale;
+                                opts.width = target.width;
+                                opts.height = target.height;
+                                opts.min_width = target.min_width;
+                                opts.min_height = target.min_height;
+                                opts.generic_resize = vm["generic_resize"].as<bool>();
+                                opts.coef_cache = vm["coef_cache"].as<bool>();
+                                opts.parallelism = find_parallelism(policy);
+                                opts.pin_threads = vm["pin_threads"].as<bool>();
+
+                                config.threads = opts.threads;
+                                config.interpolation = interpolation;
+                                config.target = target_str;
+                                config.generic_resize = opts.generic_resize;
+                                config.coef_cache = opts.coef_cache;
+                                config.parallelism = policy;
+                                std::string line = run_config(config, paths, opts);
+                                std::cout << line << std::endl;
+                                if (output)
+                                    output << line << std::endl;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    } catch (std::exception &e) {
+        std::cerr << "Benchmark failed: " << e.what() << std::endl;
+        return (1);
+    }
+    return (0);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+/*
+ * In-memory API of libresize, for programs resizing images in-process
+ * rather than through the resize command. Calls are thread-safe, decode
+ * and resize buffers are reused across calls made on the same thread.
+ *
+ *     libresize_options options;
+ *     options.target = "512x";
+ *     std::vector<uchar> output;
+ *     if (libresize_buffer(options, input.data(), input.size(), output) == LIBRESIZE_STATUS::OK)
+ *         send(output);
+ */
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+struct libresize_options
+{
+    std::string target;                                         // scale:F, WxH, Wx, xH or min:WxH, as in --renditions
+    std::string format;                                         // Default : same as input (jpg, jpeg, png, webp, avif)
+    int jpeg_quality = 95;                                      // Default : 95
+    cv::InterpolationFlags down_interpolation = cv::INTER_AREA; // Default : INTER_AREA
+    cv::InterpolationFlags up_interpolation = cv::INTER_LINEAR; // Default : INTER_LINEAR
+    bool decode_scaling = true;                                 // Default : true, decode JPEGs at 1/2, 1/4 or 1/8 size when the target allows it
+};
+
+enum class LIBRESIZE_STATUS
+{
+    OK,
+    SKIPPED,         // the image already has the target size, or is under a min: target
+    INVALID_OPTIONS, // bad target or format, or a target rounding to zero pixels
+    DECODE_FAILED,
+    RESIZE_FAILED,
+    ENCODE_FAILED
+};
+
+/**
+ * @brief Calculates the size an image would be resized to
+ *
+ * @param options Resize options, only the target is used
+ * @param cols Width of the source image
+ * @param rows Height of the source image
+ * @param width Filled with the target width
+ * @param height Filled with the target height
+ * @return LIBRESIZE_STATUS OK, SKIPPED or INVALID_OPTIONS
+ */
+LIBRESIZE_STATUS libresize_target_size(const libresize_options &options, int cols, int rows, int &width, int &height);
+
+/**
+ * @brief Resizes a decoded image
+ *
+ * @param options Resize options, format and jpeg_quality are unused
+ * @param src Image to resize
+ * @param dst Filled with the resized image, left untouched unless OK
+ */
+LIBRESIZE_STATUS libresize_mat(const libresize_options &options, const cv::Mat &src, cv::Mat &dst);
+
+/**
+ * @brief Resizes a decoded image and encodes it
+ *
+ * @param options Resize options, format is required
+ * @param src Image to resize, BGR(A) as OpenCV decodes it
+ * @param output Filled with the encoded image, left untouched unless OK
+ */
+LIBRESIZE_STATUS libresize_mat(const libresize_options &options, const cv::Mat &src, std::vector<uchar> &output);
+
+/**
+ * @brief Decodes, resizes and encodes an image held in memory
+ *
+ * @param options Resize options, format defaults to the format of the input
+ * @param data Encoded image
+ * @param size Size of the encoded image in bytes
+ * @param output Filled with the encoded image, left untouched unless OK
+ */
+LIBRESIZE_STATUS libresize_buffer(const libresize_options &options, const uchar *data, size_t size, std::vector<uchar> &output);
+
+/**
+ * @brief Describes a status, for logs
+ */
+const char *libresize_status_string(LIBRESIZE_STATUS status);
@@ -1,6 +1,14 @@
 #pragma once
 
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <unordered_set>
 #include <iostream>
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
@@ -8,6 +16,7 @@
 #include <boost/program_options/parsers.hpp>
 #include <opencv2/opencv.hpp>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <set>
 #include <map>
@@ -22,6 +31,94 @@ enum class RESIZE_METHOD
     MIN_HEIGHT_WIDTH
 };
 
+enum class RESIZE_STATUS
+{
+    RESIZE,
+    SAME_SIZE,
+    TOO_SMALL
+};
+
+enum class PARALLELISM
+{
+    AUTO,  // images decoded to intra_threshold pixels or more run alone on every core once the queue is shorter than the worker count
+    INTER, // many images at once, each on a single core
+    INTRA  // one image at a time, on every core
+};
+
+enum class ORDER
+{
+    DISCOVERY,    // images are queued as they are found
+    LARGEST_FIRST // images are probed once discovery ends and queued by decreasing cost
+};
+
+enum class STREAM_STATUS
+{
+    DONE,
+    FAILED,
+    UNSUPPORTED // the image has to go through the regular decoder
+};
+
+enum class DECODE_SCALING
+{
+    OFF,     // always decode at full resolution
+    QUALITY, // reduced decode keeps at least twice the target size
+    SPEED    // reduced decode keeps at least the target size
+};
+
+enum class IMAGE_FORMAT
+{
+    UNKNOWN,
+    JPEG,
+    PNG,
+    WEBP,
+    AVIF
+};
+
+struct image_info
+{
+    IMAGE_FORMAT format = IMAGE_FORMAT::UNKNOWN;
+    int width = 0;
+    int height = 0;
+    int channels = 0; // color components stored in the file (3 for palettes)
+    int depth = 0;    // bits per component
+};
+
+struct target_spec
+{
+    RESIZE_METHOD method;
+    float scale;
+    int width;
+    int height;
+    int min_width;
+    int min_height;
+};
+
+struct rendition
+{
+    target_spec target;
+    std::string suffix;
+};
+
+struct pool_counters
+{
+    uint64_t reused;       // buffers handed out without allocating
+    uint64_t reused_bytes; // bytes those allocations would have cost
+    uint64_t grown;        // buffers allocated or grown
+    uint64_t mispredicted; // decodes that didn't fit the pooled Mat
+};
+
+struct coef_cache_counters
+{
+    uint64_t hits;   // resizes that found their coefficient tables cached
+    uint64_t misses; // resizes that computed them
+    size_t entries;  // geometries currently cached
+};
+
+// buffer pool slots, renditions use POOL_RENDITION + their index
+const int POOL_DECODE = 0;
+const int POOL_RESIZE = 1;
+const int POOL_RENDITION = 2;
+
 struct resize_opts
 {
     bool keep;      // Default : false
@@ -31,24 +128,387 @@ struct resize_opts
     bool delete_fails; // Default : true
     bool dry_run; // Default : false
     bool summary; // Default : false
+    bool schedule_report; // Default : false
+    bool pipeline; // Default : false
+    bool generic_resize; // Default : false
+    bool coef_cache;     // Default : false
     cv::InterpolationFlags down_interpolation; // Default : cv::INTER_AREA
     cv::InterpolationFlags up_interpolation;   // Default : cv::INTER_LINEAR
+    DECODE_SCALING decode_scaling; // Default : DECODE_SCALING::QUALITY
+    PARALLELISM parallelism;       // Default : PARALLELISM::AUTO
+    uint64_t intra_threshold;      // Default : 16 megapixels
+    bool pin_threads;              // Default : false
+    uint64_t stream_threshold;     // Default : 100 megapixels, 0 disables streaming
+    uint64_t memory_budget;        // Default : 0 (no limit)
+    ORDER order;                   // Default : ORDER::DISCOVERY
     float scale;      // Compulsory if height and width are not set
     int jpeg_quality; // Default : 95
-    std::set<std::string> extensions; // Default : {"jpg", "jpeg", "png"}
+    std::set<std::string, std::less<>> extensions; // Default : {"jpg", "jpeg", "png", "webp", "avif"}, looked up by string_view
     std::string output_format; // Default : "" (same as input)
     std::string suffix;   // Default : "_resized" (keep must be set)
+    std::string manifest; // Default : "" (no manifest)
+    std::string stats;    // Default : "" (no stats), "-" prints them without JSON report
+    std::string serve;    // Default : "" (no server), "-" reads jobs from stdin
+    std::string files_from; // Default : "" (positional files only), "-" reads the list from stdin
+    std::string tar_input;  // Default : "" (no archive), "-" reads the archive from stdin
+    std::string tar_output; // Default : "" (one file per output)
+    int shard_index;          // Default : 0
+    int shard_count;          // Default : 1 (no sharding)
+    std::string shard_claims; // Default : "" (no claims, shards are never stolen from)
+    bool watch;               // Default : false
+    bool manifest_hash;   // Default : false (manifest must be set)
     int threads; // Default : std::thread::hardware_concurrency()
+    int read_threads;   // Default : 2 (pipeline must be set)
+    int resize_threads; // Default : threads (pipeline must be set)
+    int write_threads;  // Default : 2 (pipeline must be set)
+    int queue_size;     // Default : 2 * resize_threads (pipeline must be set)
     int height;  // scale will override this
     int width;   // scale will override this
     int min_height; // compulsory if min_width is set
     int min_width; // compulsory if min_height is set
     RESIZE_METHOD method;
+    std::vector<rendition> renditions; // Default : empty (single output)
+};
+
+struct serve_job;
+
+struct task
+{
+    std::string path;
+    std::shared_ptr<serve_job> job; // set for jobs received in server mode
+    uint64_t memory = 0;            // estimated bytes, set once deferred for lack of memory
+};
+
+struct worker_stats
+{
+    size_t images = 0; // tasks processed by the worker
+    size_t steals = 0; // tasks taken from another worker's deque
+    double busy = 0.0; // seconds spent processing tasks
+    double idle = 0.0; // seconds spent waiting for a task
+};
+
+/**
+ * @brief Work-stealing task queue, each worker owns a deque and takes from
+ * its front, idle workers steal from the back of the other deques.
+ */
+class scheduler
+{
+public:
+    explicit scheduler(int workers);
+
+    void push(task t);
+    void defer(task t);
+    void wait_below(size_t limit);
+    void close();
+    bool pop(int worker, task &t);
+
+    size_t queued();
+    int workers() const;
+    const std::vector<worker_stats> &stats() const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct worker_queue
+    {
+        std::mutex mtx;
+        std::deque<task> tasks;
+        clock::time_point last_pop;
+        bool running = false; // true while the worker processes a task
+    };
+
+    bool try_pop(int worker, task &t);
+    bool try_pop_deferred(task &t, bool fitting);
+
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    std::mutex deferred_mtx;
+    std::deque<task> deferred; // tasks waiting for memory, oldest first
+    std::atomic<size_t> deferred_size{0};
+    std::vector<worker_stats> counters;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::condition_variable space; // producers waiting in wait_below
+    size_t pending = 0;
+    size_t waiting = 0;
+    std::atomic<size_t> next{0}; // round-robin cursor, producers push concurrently in server mode
+    bool closed = false;
+};
+
+enum class STAGE
+{
+    DISCOVER,
+    PROBE,
+    DECODE,
+    RESIZE,
+    ENCODE,
+    WRITE
+};
+
+/**
+ * @brief Times a stage from construction to destruction into thread-local
+ * counters, no-op unless stats are enabled
+ */
+class stage_timer
+{
+public:
+    explicit stage_timer(STAGE stage);
+    ~stage_timer();
+
+private:
+    STAGE stage;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+};
+
+/**
+ * @brief Holds the parallelism gate while an image is processed, shared for
+ * images processed single-threaded, exclusive for images given every core
+ */
+class parallel_scope
+{
+public:
+    parallel_scope(const resize_opts &opts, uint64_t pixels);
+    ~parallel_scope();
+
+    parallel_scope(const parallel_scope &) = delete;
+    parallel_scope &operator=(const parallel_scope &) = delete;
+
+private:
+    const resize_opts &opts;
+    bool active;
+    bool exclusive = false;
+};
+
+/**
+ * @brief Memory reserved under --memory_budget, released on destruction
+ */
+class memory_reservation
+{
+public:
+    memory_reservation();
+    ~memory_reservation();
+    memory_reservation(const memory_reservation &) = delete;
+    memory_reservation &operator=(const memory_reservation &) = delete;
+
+    bool admit(task &t, uint64_t size);
+
+private:
+    uint64_t bytes;
+};
+
+/**
+ * @brief Read-only memory mapping of a whole file, unmapped on destruction.
+ * Files held in memory (memory_file_add) are used in place.
+ */
+class mapped_file
+{
+public:
+    mapped_file();
+    ~mapped_file();
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    bool open(const std::string &path);
+    void close();
+    const uchar *data() const;
+    size_t size() const;
+
+private:
+    const uchar *ptr;
+    size_t length;
+    std::shared_ptr<const std::vector<uchar>> memory; // set when the file is held in memory
+};
+
+/**
+ * @brief File written through a temporary next to its destination and
+ * renamed over it on commit, discarded if never committed
+ */
+class atomic_file
+{
+public:
+    atomic_file();
+    ~atomic_file();
+    atomic_file(const atomic_file &) = delete;
+    atomic_file &operator=(const atomic_file &) = delete;
+
+    bool open(const std::string &path);
+    FILE *stream() const;
+    bool commit();
+
+private:
+    std::string path;
+    std::string tmp_path;
+    FILE *file;
+};
+
+typedef std::function<void(const std::string &)> file_callback;
+
+class duplicate_filter
+{
+public:
+    explicit duplicate_filter(bool enabled);
+
+    bool insert(const std::string &path);
+    bool insert(uint64_t dev, uint64_t ino);
+
+private:
+    struct file_id
+    {
+        uint64_t dev;
+        uint64_t ino;
+        bool operator==(const file_id &other) const { return dev == other.dev && ino == other.ino; }
+    };
+
+    struct file_id_hash
+    {
+        size_t operator()(const file_id &id) const;
+    };
+
+    bool enabled;
+    std::mutex mtx;
+    std::unordered_set<file_id, file_id_hash> seen;
+};
+
+/**
+ * @brief Fixed capacity FIFO shared by pipeline stages, push blocks while
+ * the queue is full and pop blocks while it is empty
+ */
+template <typename T>
+class bounded_queue
+{
+public:
+    explicit bounded_queue(size_t capacity) : capacity(capacity) {}
+
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_full.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        lock.unlock();
+        not_empty.notify_one();
+    }
+
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_empty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty())
+            return false; // closed and drained
+        item = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+        }
+        not_empty.notify_all();
+    }
+
+private:
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+    std::mutex mtx;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
 };
 
+resize_opts default_options();
+PARALLELISM find_parallelism(const std::string &str);
+ORDER find_order(const std::string &str);
+cv::InterpolationFlags find_interpolation(const std::string &str);
 resize_opts interpret_options(po::variables_map &vm);
-void process_image(resize_opts &opts, const std::string & path);
-void process_chunk(resize_opts &opts, std::vector<std::string> & files, size_t &total);
-void fill_set(std::set<std::string> &files, resize_opts &options, const std::string &path);
-void update_progress_bar(size_t &total);
-void print_summary(resize_opts &opts, const std::vector<std::string> &paths);
\ No newline at end of file
+bool process_image(resize_opts &opts, task &t);
+bool decode_image(resize_opts &opts, const std::string &path, const image_info &info, const cv::Size &target, cv::Mat &image, cv::Size &source, bool pooled);
+bool skip_from_header(resize_opts &opts, const std::string &path, image_info &info, cv::Size &target);
+bool probe_image(const std::string &path, image_info &info);
+bool probe_buffer(const uchar *data, size_t size, image_info &info);
+int reduced_decode_scale(int flags);
+int reduced_decode_flag(resize_opts &opts, const image_info &info, const cv::Size &target);
+uint64_t decoded_pixels(resize_opts &opts, const image_info &info, const cv::Size &target);
+RESIZE_STATUS compute_target_size(const target_spec &target, int cols, int rows, int &width, int &height);
+RESIZE_STATUS compute_target_size(resize_opts &opts, int cols, int rows, int &width, int &height);
+target_spec main_target(resize_opts &opts);
+target_spec parse_target_spec(const std::string &spec);
+std::string target_error(const target_spec &target);
+std::string make_output_path(resize_opts &opts, const std::string &path);
+std::string make_output_path(resize_opts &opts, const std::string &path, const std::string &suffix);
+bool is_output_name(const resize_opts &opts, const std::string &path);
+void report_skip(resize_opts &opts, const std::string &path, RESIZE_STATUS status, int width, int height);
+bool resize_image(resize_opts &opts, const std::string &path, const cv::Mat &src, cv::Mat &dst, int width, int height);
+bool process_renditions(resize_opts &opts, task &t);
+bool write_image(resize_opts &opts, const std::string &path, const std::string &output_path, const cv::Mat &image);
+bool stream_eligible(const resize_opts &opts, const image_info &info, const cv::Size &target);
+STREAM_STATUS stream_resize(resize_opts &opts, const std::string &path, const image_info &info, int width, int height, const std::string &output_path);
+void dry_run_print(const std::string &path, int &width, int &height, bool noop, const std::string &output_path);
+void process_queue(resize_opts &opts, scheduler &sched, int worker);
+void run_pipeline(resize_opts &opts, scheduler &sched);
+bool extension_is_valid(std::string_view path, const resize_opts &options);
+void discover_files(resize_opts &options, const std::string &path, duplicate_filter &duplicates, const file_callback &found);
+size_t discovered_directory_count();
+bool read_file_list(resize_opts &options, const std::string &source, const file_callback &found);
+void manifest_load(resize_opts &opts);
+bool manifest_unchanged(resize_opts &opts, const std::string &path);
+void manifest_record(resize_opts &opts, const std::string &path);
+uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL);
+bool box_downscale_supported(const cv::Mat &src, int width, int height);
+void box_downscale(const cv::Mat &src, cv::Mat &dst, int width, int height);
+const char *box_downscale_kernel();
+bool separable_resize_supported(const cv::Mat &src, int width, int height, int interpolation);
+void separable_resize(const cv::Mat &src, cv::Mat &dst, int width, int height, int interpolation);
+coef_cache_counters get_coef_cache_counters();
+cv::Mat pooled_mat(int slot, cv::Size size, int type);
+void pool_count_reuse(bool reuse, size_t bytes);
+void pool_count_mispredicted();
+pool_counters get_pool_counters();
+cv::Size predict_decoded_size(const image_info &info, int flags, int &type);
+bool write_file_atomic(const std::string &path, const std::vector<uchar> &data);
+void output_tracking(bool enabled);
+bool written_by_run(const std::string &path);
+bool memory_file_add(const std::string &path, std::shared_ptr<const std::vector<uchar>> data);
+std::shared_ptr<const std::vector<uchar>> memory_file_find(const std::string &path);
+void memory_file_remove(const std::string &path);
+bool tar_output_open(const resize_opts &opts);
+bool tar_output_active();
+bool tar_write(const std::string &path, const std::vector<uchar> &data);
+bool tar_output_close(const resize_opts &opts);
+bool read_tar(resize_opts &options, const std::string &source, const file_callback &found);
+bool shard_owns(const resize_opts &opts, std::string_view path);
+bool shard_claim(const resize_opts &opts, const std::string &path);
+void shard_claim_output(const resize_opts &opts, const std::string &output_path);
+size_t shard_claims_won();
+size_t shard_claims_lost();
+bool watch_start(const std::vector<std::string> &inputs);
+void watch_run(resize_opts &opts, const std::vector<std::string> &inputs, const file_callback &found);
+void watch_note_output(const std::string &path);
+void watch_note_found(const std::string &path);
+void stats_enable();
+bool stats_enabled();
+void stats_add_bytes(uint64_t read, uint64_t written);
+void print_stats(resize_opts &opts, double elapsed);
+void progress_start(resize_opts &opts, std::atomic<size_t> &files);
+void progress_discovery_done();
+void progress_image_done();
+void progress_add_bytes(uint64_t read);
+void progress_stop();
+int serve(resize_opts &opts, scheduler &sched);
+void serve_run_job(resize_opts &opts, serve_job &job);
+std::string json_escape(const std::string &str);
+void parallelism_init(const resize_opts &opts, scheduler &sched);
+size_t parallelism_exclusive_count();
+void order_largest_first(resize_opts &opts, std::vector<std::string> &paths);
+void print_makespan_report(const scheduler &sched, double elapsed);
+void memory_budget_init(const resize_opts &opts);
+bool memory_budget_fits(uint64_t bytes);
+uint64_t estimate_image_memory(resize_opts &opts, const image_info &info, const cv::Size &target, const std::vector<cv::Size> &outputs);
+size_t memory_budget_deferred_count();
+uint64_t memory_budget_peak();
+void pin_thread(std::thread &thread, int worker);
+void print_summary(resize_opts &opts, const std::vector<std::string> &paths);
+void print_schedule_report(const scheduler &sched, double elapsed);
\ No newline at end of file
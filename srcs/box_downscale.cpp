@@ -0,0 +1,402 @@
+#include "resize.hpp"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define BOX_X86 1
+#endif
+
+/*
+ * Box filter for exact integer downscales, bit-exact with what INTER_AREA
+ * computes when the source is a multiple of the target. cv::resize sums
+ * each fx * fy block per channel and rounds the sum times the reciprocal
+ * of the area, in single precision, half to even:
+ *
+ *     dst = cvRound(sum * (1.f / area))
+ *
+ * Rows of a block are summed into a 32 bit accumulator row, then fx
+ * neighbours are summed and scaled. The SIMD paths do the same float
+ * multiply and round with the default rounding mode, sums stay below 2^24
+ * so they convert to float exactly and every path returns the samples
+ * cv::resize does. 2x2 blocks are left to cv::resize, its vectorized 2x2
+ * path rounds half up except at the end of rows.
+ */
+
+static const int max_area = 256;
+
+typedef void (*accumulate_fn)(const uchar *src, uint32_t *acc, int n, bool first);
+typedef void (*reduce_fn)(const uint32_t *acc, uchar *dst, int width, int cn, int fx, float scale, bool wide);
+
+template <typename T>
+static void accumulate_scalar(const uchar *src, uint32_t *acc, int n, bool first)
+{
+    const T *row = reinterpret_cast<const T *>(src);
+
+    if (first)
+        for (int i = 0; i < n; i++)
+            acc[i] = row[i];
+    else
+        for (int i = 0; i < n; i++)
+            acc[i] += row[i];
+}
+
+/**
+ * @brief Reference reduction, sums fx neighbouring pixels of the
+ * accumulator row and scales them by the reciprocal of the block area
+ *
+ * @param acc Accumulator row, fx * width pixels of cn channels
+ * @param dst Output row
+ * @param width Output width
+ * @param cn Number of channels
+ * @param fx Horizontal factor
+ * @param scale 1.f / block area
+ * @param wide Whether the output is 16 bits
+ */
+static void reduce_scalar(const uint32_t *acc, uchar *dst, int width, int cn, int fx, float scale, bool wide)
+{
+    uint16_t *dst16 = reinterpret_cast<uint16_t *>(dst);
+
+    for (int x = 0; x < width; x++)
+    {
+        for (int c = 0; c < cn; c++)
+        {
+            uint32_t sum = 0;
+            for (int k = 0; k < fx; k++)
+                sum += acc[(x * fx + k) * cn + c];
+            float value = static_cast<float>(sum) * scale;
+            if (wide)
+                dst16[x * cn + c] = cv::saturate_cast<uint16_t>(value);
+            else
+                dst[x * cn + c] = cv::saturate_cast<uchar>(value);
+        }
+    }
+}
+
+#ifdef BOX_X86
+
+__attribute__((target("sse4.1")))
+static void accumulate_u8_sse41(const uchar *src, uint32_t *acc, int n, bool first)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i a[4] = {
+            _mm_cvtepu8_epi32(v),
+            _mm_cvtepu8_epi32(_mm_srli_si128(v, 4)),
+            _mm_cvtepu8_epi32(_mm_srli_si128(v, 8)),
+            _mm_cvtepu8_epi32(_mm_srli_si128(v, 12)),
+        };
+        __m128i *out = reinterpret_cast<__m128i *>(acc + i);
+        for (int j = 0; j < 4; j++)
+        {
+            if (!first)
+                a[j] = _mm_add_epi32(a[j], _mm_loadu_si128(out + j));
+            _mm_storeu_si128(out + j, a[j]);
+        }
+    }
+    accumulate_scalar<uint8_t>(src + i, acc + i, n - i, first);
+}
+
+__attribute__((target("sse4.1")))
+static void accumulate_u16_sse41(const uchar *src, uint32_t *acc, int n, bool first)
+{
+    const uint16_t *row = reinterpret_cast<const uint16_t *>(src);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+        __m128i a[2] = {_mm_cvtepu16_epi32(v), _mm_cvtepu16_epi32(_mm_srli_si128(v, 8))};
+        __m128i *out = reinterpret_cast<__m128i *>(acc + i);
+        for (int j = 0; j < 2; j++)
+        {
+            if (!first)
+                a[j] = _mm_add_epi32(a[j], _mm_loadu_si128(out + j));
+            _mm_storeu_si128(out + j, a[j]);
+        }
+    }
+    accumulate_scalar<uint16_t>(reinterpret_cast<const uchar *>(row + i), acc + i, n - i, first);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_u8_avx2(const uchar *src, uint32_t *acc, int n, bool first)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m256i a[2] = {_mm256_cvtepu8_epi32(v), _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8))};
+        __m256i *out = reinterpret_cast<__m256i *>(acc + i);
+        for (int j = 0; j < 2; j++)
+        {
+            if (!first)
+                a[j] = _mm256_add_epi32(a[j], _mm256_loadu_si256(out + j));
+            _mm256_storeu_si256(out + j, a[j]);
+        }
+    }
+    accumulate_scalar<uint8_t>(src + i, acc + i, n - i, first);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_u16_avx2(const uchar *src, uint32_t *acc, int n, bool first)
+{
+    const uint16_t *row = reinterpret_cast<const uint16_t *>(src);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i));
+        __m256i a[2] = {_mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1))};
+        __m256i *out = reinterpret_cast<__m256i *>(acc + i);
+        for (int j = 0; j < 2; j++)
+        {
+            if (!first)
+                a[j] = _mm256_add_epi32(a[j], _mm256_loadu_si256(out + j));
+            _mm256_storeu_si256(out + j, a[j]);
+        }
+    }
+    accumulate_scalar<uint16_t>(reinterpret_cast<const uchar *>(row + i), acc + i, n - i, first);
+}
+
+/**
+ * @brief Scales four sums, rounded half to even as cvRound does
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i scale_sse41(__m128i sum, __m128 scale)
+{
+    return _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sum), scale));
+}
+
+/**
+ * @brief Stores four quotients as 8 or 16 bit samples
+ */
+__attribute__((target("sse4.1")))
+static inline void store4_sse41(uchar *dst, __m128i q, bool wide)
+{
+    __m128i packed = _mm_packus_epi32(q, q);
+    if (wide)
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), packed);
+    else
+    {
+        int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+        std::memcpy(dst, &bytes, sizeof(bytes));
+    }
+}
+
+/**
+ * @brief Same as reduce_scalar, four outputs at a time for single channel
+ * images halved or quartered, one pixel at a time for 3 and 4 channels
+ */
+__attribute__((target("sse4.1")))
+static void reduce_sse41(const uint32_t *acc, uchar *dst, int width, int cn, int fx, float scale, bool wide)
+{
+    const __m128 factor = _mm_set1_ps(scale);
+    const int size = wide ? 2 : 1;
+    int x = 0;
+
+    if (cn == 1 && (fx == 1 || fx == 2 || fx == 4))
+    {
+        for (; x + 4 <= width; x += 4)
+        {
+            const __m128i *in = reinterpret_cast<const __m128i *>(acc + x * fx);
+            __m128i sum;
+            if (fx == 1)
+                sum = _mm_loadu_si128(in);
+            else if (fx == 2)
+                sum = _mm_hadd_epi32(_mm_loadu_si128(in), _mm_loadu_si128(in + 1));
+            else
+                sum = _mm_hadd_epi32(_mm_hadd_epi32(_mm_loadu_si128(in), _mm_loadu_si128(in + 1)),
+                                     _mm_hadd_epi32(_mm_loadu_si128(in + 2), _mm_loadu_si128(in + 3)));
+            store4_sse41(dst + x * size, scale_sse41(sum, factor), wide);
+        }
+    }
+    else if (cn == 3 || cn == 4)
+    {
+        // a 3 channel pixel is loaded with the next sample and stored with a
+        // spare sample that the next pixel overwrites, the last one is scalar
+        int vector_width = (cn == 4) ? width : width - 1;
+        for (; x < vector_width; x++)
+        {
+            const uint32_t *in = acc + x * fx * cn;
+            __m128i sum = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+            for (int k = 1; k < fx; k++)
+                sum = _mm_add_epi32(sum, _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + k * cn)));
+            store4_sse41(dst + x * cn * size, scale_sse41(sum, factor), wide);
+        }
+    }
+    reduce_scalar(acc + x * fx * cn, dst + x * cn * size, width - x, cn, fx, scale, wide);
+}
+
+/**
+ * @brief Sums neighbouring pairs of two rows of eight, in order
+ */
+__attribute__((target("avx2")))
+static inline __m256i hadd_avx2(__m256i a, __m256i b)
+{
+    // hadd works within 128 bit lanes, put the a sums before the b sums
+    return _mm256_permute4x64_epi64(_mm256_hadd_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+/**
+ * @brief Same as scale_sse41, eight sums at a time
+ */
+__attribute__((target("avx2")))
+static inline __m256i scale_avx2(__m256i sum, __m256 scale)
+{
+    return _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(sum), scale));
+}
+
+/**
+ * @brief Stores eight quotients as 8 or 16 bit samples
+ */
+__attribute__((target("avx2")))
+static inline void store8_avx2(uchar *dst, __m256i q, bool wide)
+{
+    __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+    if (wide)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), packed);
+    else
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), _mm_packus_epi16(packed, packed));
+}
+
+/**
+ * @brief Same as reduce_sse41, eight outputs at a time for single channel
+ * images halved or quartered, two pixels at a time for 4 channels. 3
+ * channel images and the tails go through reduce_sse41
+ */
+__attribute__((target("avx2")))
+static void reduce_avx2(const uint32_t *acc, uchar *dst, int width, int cn, int fx, float scale, bool wide)
+{
+    const __m256 factor = _mm256_set1_ps(scale);
+    const int size = wide ? 2 : 1;
+    int x = 0;
+
+    if (cn == 1 && (fx == 1 || fx == 2 || fx == 4))
+    {
+        for (; x + 8 <= width; x += 8)
+        {
+            const __m256i *in = reinterpret_cast<const __m256i *>(acc + x * fx);
+            __m256i sum;
+            if (fx == 1)
+                sum = _mm256_loadu_si256(in);
+            else if (fx == 2)
+                sum = hadd_avx2(_mm256_loadu_si256(in), _mm256_loadu_si256(in + 1));
+            else
+                sum = hadd_avx2(hadd_avx2(_mm256_loadu_si256(in), _mm256_loadu_si256(in + 1)),
+                                hadd_avx2(_mm256_loadu_si256(in + 2), _mm256_loadu_si256(in + 3)));
+            store8_avx2(dst + x * size, scale_avx2(sum, factor), wide);
+        }
+    }
+    else if (cn == 4)
+    {
+        for (; x + 2 <= width; x += 2)
+        {
+            const __m128i *first = reinterpret_cast<const __m128i *>(acc + x * fx * 4);
+            const __m128i *second = reinterpret_cast<const __m128i *>(acc + (x + 1) * fx * 4);
+            __m256i sum = _mm256_setzero_si256();
+            for (int k = 0; k < fx; k++)
+            {
+                __m256i pair = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(first + k)), _mm_loadu_si128(second + k), 1);
+                sum = _mm256_add_epi32(sum, pair);
+            }
+            store8_avx2(dst + x * 4 * size, scale_avx2(sum, factor), wide);
+        }
+    }
+    reduce_sse41(acc + x * fx * cn, dst + x * cn * size, width - x, cn, fx, scale, wide);
+}
+
+#endif
+
+struct box_kernels
+{
+    accumulate_fn accumulate_u8;
+    accumulate_fn accumulate_u16;
+    reduce_fn reduce;
+    const char *name;
+};
+
+/**
+ * @brief Picks the widest kernels the CPU supports, once
+ */
+static const box_kernels &select_kernels()
+{
+    static const box_kernels kernels = []() {
+#ifdef BOX_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return box_kernels{accumulate_u8_avx2, accumulate_u16_avx2, reduce_avx2, "avx2"};
+        if (__builtin_cpu_supports("sse4.1"))
+            return box_kernels{accumulate_u8_sse41, accumulate_u16_sse41, reduce_sse41, "sse4.1"};
+#endif
+        return box_kernels{accumulate_scalar<uint8_t>, accumulate_scalar<uint16_t>, reduce_scalar, "scalar"};
+    }();
+    return kernels;
+}
+
+/**
+ * @brief Name of the kernels used on this CPU
+ */
+const char *box_downscale_kernel()
+{
+    return select_kernels().name;
+}
+
+/**
+ * @brief Checks that an image can be downscaled with the box kernel
+ *
+ * @param src Image to resize
+ * @param width Target width
+ * @param height Target height
+ * @return true If src is 8 or 16 bit with 1, 3 or 4 channels, and is an
+ * exact multiple of the target with a block area of 2 to 256 pixels, other
+ * than 2x2
+ */
+bool box_downscale_supported(const cv::Mat &src, int width, int height)
+{
+    if (src.depth() != CV_8U && src.depth() != CV_16U)
+        return false;
+    if (src.channels() != 1 && src.channels() != 3 && src.channels() != 4)
+        return false;
+    if (width <= 0 || height <= 0 || src.cols % width || src.rows % height)
+        return false;
+
+    int fx = src.cols / width;
+    int fy = src.rows / height;
+    if (fx == 2 && fy == 2)
+        return false; // cv::resize has its own 2x2 kernel, which rounds differently
+    return fx * fy >= 2 && fx * fy <= max_area;
+}
+
+/**
+ * @brief Downscales an image by exact integer factors with a box filter,
+ * box_downscale_supported must be true
+ *
+ * @param src Image to resize
+ * @param dst Filled with the resized image, its buffer is reused when it
+ * already has the right size and type
+ * @param width Target width
+ * @param height Target height
+ */
+void box_downscale(const cv::Mat &src, cv::Mat &dst, int width, int height)
+{
+    const box_kernels &kernels = select_kernels();
+    cv::Mat source = src; // dst may be src
+    int fx = source.cols / width;
+    int fy = source.rows / height;
+    int cn = source.channels();
+    bool wide = source.depth() == CV_16U;
+    float scale = 1.f / (fx * fy);
+    accumulate_fn accumulate = wide ? kernels.accumulate_u16 : kernels.accumulate_u8;
+
+    dst.create(height, width, source.type());
+    cv::parallel_for_(cv::Range(0, height), [&](const cv::Range &range) {
+        // padded for the spare sample read by 3 channel pixels
+        thread_local std::vector<uint32_t> acc;
+        acc.resize(source.cols * cn + 4);
+        for (int y = range.start; y < range.end; y++)
+        {
+            for (int r = 0; r < fy; r++)
+                accumulate(source.ptr(y * fy + r), acc.data(), source.cols * cn, r == 0);
+            kernels.reduce(acc.data(), dst.ptr(y), width, cn, fx, scale, wide);
+        }
+    });
+}
@@ -0,0 +1,126 @@
+#include "resize.hpp"
+
+/*
+ * Each thread keeps one growing buffer per slot (decode, resize, one per
+ * rendition). Mats handed out are headers over that memory, so cv::imdecode
+ * and cv::resize skip the allocation whenever their destination already has
+ * the right size and type. Buffers only grow, up to the largest image seen.
+ */
+
+struct pool_buffer
+{
+    std::unique_ptr<uchar[]> data;
+    size_t capacity = 0;
+};
+
+static std::atomic<uint64_t> reused(0);
+static std::atomic<uint64_t> reused_bytes(0);
+static std::atomic<uint64_t> grown(0);
+static std::atomic<uint64_t> mispredicted(0);
+
+/**
+ * @brief Gets a Mat backed by the calling thread's buffer for a slot, the
+ * Mat is only valid on this thread until the slot is requested again
+ *
+ * @param slot Buffer to use, POOL_RENDITION + i for the i-th rendition
+ * @param size Size of the Mat
+ * @param type OpenCV type of the Mat
+ * @return cv::Mat Header over the pooled memory
+ */
+cv::Mat pooled_mat(int slot, cv::Size size, int type)
+{
+    thread_local std::vector<pool_buffer> buffers;
+    size_t bytes = static_cast<size_t>(size.width) * size.height * CV_ELEM_SIZE(type);
+
+    if (slot >= static_cast<int>(buffers.size()))
+        buffers.resize(slot + 1);
+    pool_buffer &buffer = buffers[slot];
+    if (buffer.capacity < bytes)
+    {
+        buffer.data.reset(); // free first, the old content is never needed
+        buffer.data.reset(new uchar[bytes]);
+        buffer.capacity = bytes;
+        grown.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        reused.fetch_add(1, std::memory_order_relaxed);
+        reused_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    return cv::Mat(size, type, buffer.data.get());
+}
+
+/**
+ * @brief Records a buffer reused outside of the Mat pool (encode buffers)
+ */
+void pool_count_reuse(bool reuse, size_t bytes)
+{
+    if (reuse)
+    {
+        reused.fetch_add(1, std::memory_order_relaxed);
+        reused_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    else
+        grown.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Records a decode whose size or type wasn't guessed from the header,
+ * OpenCV allocated its own Mat
+ */
+void pool_count_mispredicted()
+{
+    mispredicted.fetch_add(1, std::memory_order_relaxed);
+}
+
+pool_counters get_pool_counters()
+{
+    pool_counters counters;
+    counters.reused = reused;
+    counters.reused_bytes = reused_bytes;
+    counters.grown = grown;
+    counters.mispredicted = mispredicted;
+    return counters;
+}
+
+/**
+ * @brief Guesses the Mat cv::imdecode will produce from the image header,
+ * following the conversions done by OpenCV's decoders
+ *
+ * @param info Header of the image
+ * @param flags cv::imdecode flags
+ * @param type Filled with the OpenCV type
+ * @return cv::Size Size of the decoded image, empty if it can't be guessed
+ */
+cv::Size predict_decoded_size(const image_info &info, int flags, int &type)
+{
+    if (info.format == IMAGE_FORMAT::UNKNOWN)
+        return cv::Size();
+
+    if (flags != cv::IMREAD_UNCHANGED)
+    {
+        // reduced JPEG decode, libjpeg rounds the scaled size up
+        int scale = reduced_decode_scale(flags);
+        type = (flags & cv::IMREAD_COLOR) ? CV_8UC3 : CV_8UC1;
+        return cv::Size((info.width + scale - 1) / scale, (info.height + scale - 1) / scale);
+    }
+
+    int depth = (info.depth > 8) ? CV_16U : CV_8U;
+    int channels = info.channels;
+    switch (info.format)
+    {
+    case IMAGE_FORMAT::JPEG:
+        depth = CV_8U;
+        channels = (channels == 1) ? 1 : 3; // CMYK is converted to BGR
+        break;
+    case IMAGE_FORMAT::PNG:
+        channels = (channels == 2) ? 4 : channels; // gray + alpha is expanded to BGRA
+        break;
+    default:
+        break;
+    }
+    if (channels < 1 || channels > 4)
+        return cv::Size();
+    type = CV_MAKETYPE(depth, channels);
+    return cv::Size(info.width, info.height);
+}
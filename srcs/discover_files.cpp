@@ -0,0 +1,227 @@
+#include "resize.hpp"
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static std::atomic<size_t> directories(0);
+
+/**
+ * @brief Checks the extension of a path against the extensions option,
+ * without allocating
+ *
+ * @param path Path or file name
+ * @param options Reference to command line options
+ * @return true If the file has one of the extensions
+ */
+bool extension_is_valid(std::string_view path, const resize_opts &options)
+{
+    size_t slash = path.find_last_of('/');
+    std::string_view name = (slash == std::string_view::npos) ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    if (dot == std::string_view::npos || name == "." || name == "..")
+        return options.extensions.count(std::string_view()) != 0;
+    return options.extensions.count(name.substr(dot + 1)) != 0;
+}
+
+size_t duplicate_filter::file_id_hash::operator()(const file_id &id) const
+{
+    return std::hash<uint64_t>()(id.ino * 31 + id.dev);
+}
+
+/**
+ * @brief Remembers the files already found by device and inode, 16 bytes per
+ * file instead of the whole path. Only needed when several input paths are
+ * given, a single tree walk never yields the same file twice.
+ *
+ * @param enabled Whether duplicates have to be tracked at all
+ */
+duplicate_filter::duplicate_filter(bool enabled) : enabled(enabled) {}
+
+bool duplicate_filter::insert(const std::string &path)
+{
+    if (!enabled)
+        return true;
+
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+        return true; // let the worker report the error
+    return insert(st.st_dev, st.st_ino);
+}
+
+/**
+ * @brief Same as insert(path), for a file whose device and inode are known
+ * from its directory entry
+ */
+bool duplicate_filter::insert(uint64_t dev, uint64_t ino)
+{
+    if (!enabled)
+        return true;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    return seen.insert({dev, ino}).second;
+}
+
+/**
+ * @brief Directories waiting to be read, shared by the walker threads
+ */
+struct walk_queue
+{
+    std::mutex mtx;
+    std::condition_variable changed;
+    std::deque<std::string> directories;
+    size_t outstanding = 0; // queued or being read, the walk ends at 0
+};
+
+/**
+ * @brief Reads one directory: subdirectories are queued, images are handed
+ * to the callback in one batch. Entries are typed from d_type, only
+ * filesystems that don't fill it in and symbolic links cost a stat.
+ */
+static void walk_directory(resize_opts &options, const std::string &path, walk_queue &queue, duplicate_filter &duplicates,
+                           const file_callback &found, std::mutex &found_mtx)
+{
+    DIR *dir = ::opendir(path.c_str());
+    if (!dir)
+    {
+        std::cerr << "Failed to open " << path << ": " << std::strerror(errno) << std::endl;
+        return;
+    }
+    directories++;
+
+    struct stat dir_st;
+    int fd = ::dirfd(dir);
+    uint64_t dev = (::fstat(fd, &dir_st) == 0) ? dir_st.st_dev : 0; // d_ino only identifies files of the same device
+    std::string prefix = (path.back() == '/') ? path : path + '/';
+    std::vector<std::string> subdirectories;
+    std::vector<std::string> files;
+
+    while (struct dirent *entry = ::readdir(dir))
+    {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        unsigned char type = entry->d_type;
+        uint64_t file_dev = dev;
+        uint64_t file_ino = entry->d_ino;
+        if (type == DT_LNK && !extension_is_valid(name, options))
+            continue; // can only matter as an image
+        if (type == DT_UNKNOWN || type == DT_LNK)
+        {
+            // symbolic links count as what they point to, but linked directories aren't walked
+            struct stat st;
+            bool link = type == DT_LNK;
+            if (::fstatat(fd, name, &st, link ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            if (S_ISLNK(st.st_mode))
+            {
+                link = true;
+                if (::fstatat(fd, name, &st, 0) != 0)
+                    continue;
+            }
+            if (S_ISDIR(st.st_mode) && !link)
+                type = DT_DIR;
+            else if (S_ISREG(st.st_mode))
+                type = DT_REG;
+            else
+                continue;
+            file_dev = st.st_dev;
+            file_ino = st.st_ino;
+        }
+
+        if (type == DT_DIR)
+            subdirectories.push_back(prefix + name);
+        else if (type == DT_REG && extension_is_valid(name, options) && duplicates.insert(file_dev, file_ino))
+            files.push_back(prefix + name);
+    }
+    ::closedir(dir);
+
+    if (!subdirectories.empty())
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue.mtx);
+            for (auto &subdirectory : subdirectories)
+                queue.directories.push_back(std::move(subdirectory));
+            queue.outstanding += subdirectories.size();
+        }
+        queue.changed.notify_all();
+    }
+    if (!files.empty())
+    {
+        std::lock_guard<std::mutex> lock(found_mtx);
+        for (auto &file : files)
+            found(file);
+    }
+}
+
+/**
+ * @brief Walks a directory tree, every thread reads directories from a
+ * shared queue so wide trees fan out over all of them
+ */
+static void walk_tree(resize_opts &options, const std::string &root, duplicate_filter &duplicates, const file_callback &found)
+{
+    walk_queue queue;
+    std::mutex found_mtx; // callers expect calls one at a time
+    queue.directories.push_back(root);
+    queue.outstanding = 1;
+
+    auto walker = [&] {
+        std::unique_lock<std::mutex> lock(queue.mtx);
+        while (true)
+        {
+            queue.changed.wait(lock, [&] { return !queue.directories.empty() || queue.outstanding == 0; });
+            if (queue.directories.empty())
+                return; // every directory was read
+            std::string path = std::move(queue.directories.front());
+            queue.directories.pop_front();
+            lock.unlock();
+            walk_directory(options, path, queue, duplicates, found, found_mtx);
+            lock.lock();
+            if (--queue.outstanding == 0)
+                queue.changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < std::max(options.threads, 1); i++)
+        threads.push_back(std::thread(walker));
+    walker();
+    for (auto &thread : threads)
+        thread.join();
+}
+
+/**
+ * @brief Number of directories read by discover_files so far
+ */
+size_t discovered_directory_count()
+{
+    return directories;
+}
+
+/**
+ * @brief Walks an input path and hands every valid image to the callback as
+ * soon as it is found
+ *
+ * @param options Reference to command line options
+ * @param path File or directory to walk
+ * @param duplicates Filter for files already found through another path
+ * @param found Called with the path of every image found
+ */
+void discover_files(resize_opts &options, const std::string &path, duplicate_filter &duplicates, const file_callback &found)
+{
+    if (!boost::filesystem::exists(path))
+        return; // skip non-existing files
+
+    // if file is a file, hand it over
+    if (boost::filesystem::is_regular_file(path))
+    {
+        if (extension_is_valid(path, options) && duplicates.insert(path))
+            found(path);
+        return;
+    }
+
+    // if file is a directory, hand over all files in it
+    if (boost::filesystem::is_directory(path))
+        walk_tree(options, path, duplicates, found);
+}
@@ -0,0 +1,75 @@
+#include "resize.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * @brief Streams the paths of a file list to the callback as they are read,
+ * only the current block and a partial path are kept in memory. The list is
+ * NUL-delimited (find -print0) if its first block holds a NUL, one path per
+ * line otherwise. Paths go through the extension filter but are not walked,
+ * stat-ed or deduplicated.
+ *
+ * @param options Reference to command line options
+ * @param source Path of the list, - for stdin
+ * @param found Called with every path of the list
+ * @return true If the whole list was read
+ */
+bool read_file_list(resize_opts &options, const std::string &source, const file_callback &found)
+{
+    int fd = (source == "-") ? STDIN_FILENO : ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open " << source << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    char buffer[1 << 16];
+    std::string path;
+    char delimiter = 0;
+    bool first = true;
+    bool success = true;
+    auto flush = [&]() {
+        if (delimiter == '\n' && !path.empty() && path.back() == '\r')
+            path.pop_back();
+        if (!path.empty() && extension_is_valid(path, options))
+            found(path);
+        path.clear();
+    };
+
+    while (true)
+    {
+        ssize_t size = ::read(fd, buffer, sizeof(buffer));
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size < 0)
+        {
+            std::cerr << "Failed to read " << source << ": " << std::strerror(errno) << std::endl;
+            success = false;
+            break;
+        }
+        if (size == 0)
+            break;
+        if (first)
+        {
+            delimiter = std::memchr(buffer, '\0', size) ? '\0' : '\n';
+            first = false;
+        }
+
+        const char *start = buffer;
+        const char *end = buffer + size;
+        const char *next;
+        while ((next = static_cast<const char *>(std::memchr(start, delimiter, end - start))))
+        {
+            path.append(start, next);
+            flush();
+            start = next + 1;
+        }
+        path.append(start, end);
+    }
+    flush(); // last path without a delimiter
+
+    if (fd != STDIN_FILENO)
+        ::close(fd);
+    return success;
+}
@@ -0,0 +1,334 @@
+#include "resize.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+/*
+ * Images read from a --tar_input archive never exist on disk, their entries
+ * are held in memory under their member name until their task is done.
+ * mapped_file and probe_image look them up before the filesystem.
+ */
+
+static std::mutex memory_files_mtx;
+static std::unordered_map<std::string, std::shared_ptr<const std::vector<uchar>>> memory_files;
+static std::atomic<size_t> memory_file_count(0);
+
+/**
+ * @brief Holds the content of a file in memory under its path
+ *
+ * @return false If a file is already held under this path
+ */
+bool memory_file_add(const std::string &path, std::shared_ptr<const std::vector<uchar>> data)
+{
+    std::lock_guard<std::mutex> lock(memory_files_mtx);
+    if (!memory_files.emplace(path, std::move(data)).second)
+        return false;
+    memory_file_count++;
+    return true;
+}
+
+/**
+ * @brief Finds a file held in memory
+ *
+ * @return Content of the file, nullptr if it isn't held in memory
+ */
+std::shared_ptr<const std::vector<uchar>> memory_file_find(const std::string &path)
+{
+    if (memory_file_count == 0)
+        return nullptr;
+    std::lock_guard<std::mutex> lock(memory_files_mtx);
+    auto it = memory_files.find(path);
+    return (it == memory_files.end()) ? nullptr : it->second;
+}
+
+/**
+ * @brief Releases a file held in memory, readers still holding it keep it
+ * alive until they are done
+ */
+void memory_file_remove(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(memory_files_mtx);
+    if (memory_files.erase(path))
+        memory_file_count--;
+}
+
+/*
+ * Outputs committed while the inputs are walked are remembered by inode,
+ * size and mtime, so a walk running into a file the run just wrote doesn't
+ * queue it as a source, whatever its name. The record is dropped once the
+ * walks are over.
+ */
+
+struct written_file
+{
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+};
+
+static std::mutex written_mtx;
+static std::atomic<bool> tracking(false);
+static std::unordered_map<std::string, written_file> written;
+
+static bool stat_written(const std::string &path, written_file &file)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+        return false;
+    file.ino = st.st_ino;
+    file.size = st.st_size;
+    file.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+/**
+ * @brief Starts or stops remembering the outputs committed, stopping forgets
+ * them
+ */
+void output_tracking(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(written_mtx);
+    tracking = enabled;
+    if (!enabled)
+        written.clear();
+}
+
+/**
+ * @brief Records an output just renamed over its destination
+ */
+static void note_output(const std::string &path)
+{
+    watch_note_output(path);
+    written_file file;
+    if (!tracking || !stat_written(path, file))
+        return;
+    std::lock_guard<std::mutex> lock(written_mtx);
+    if (tracking)
+        written[path] = file;
+}
+
+/**
+ * @brief Checks whether a discovered file is an output of this run, left
+ * unchanged since it was written, only stats files written by the run
+ *
+ * @param path Path of the file
+ */
+bool written_by_run(const std::string &path)
+{
+    if (!tracking)
+        return false;
+    written_file recorded;
+    {
+        std::lock_guard<std::mutex> lock(written_mtx);
+        auto it = written.find(path);
+        if (it == written.end())
+            return false;
+        recorded = it->second;
+    }
+    written_file current;
+    return stat_written(path, current) && current.ino == recorded.ino && current.size == recorded.size &&
+           current.mtime_ns == recorded.mtime_ns;
+}
+
+mapped_file::mapped_file() : ptr(nullptr), length(0) {}
+
+mapped_file::~mapped_file()
+{
+    close();
+}
+
+/**
+ * @brief Maps a whole file read-only, the kernel is told it will be read
+ * sequentially so readahead kicks in before the decoder touches the pages
+ *
+ * @param path Path to the file
+ * @return true If the file was mapped, empty files are never mapped
+ */
+bool mapped_file::open(const std::string &path)
+{
+    close();
+    if ((memory = memory_file_find(path)))
+    {
+        if (memory->empty())
+        {
+            memory.reset();
+            return false;
+        }
+        ptr = memory->data();
+        length = memory->size();
+        return true;
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void *mapping = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps the file alive
+    if (mapping == MAP_FAILED)
+        return false;
+    // advice values are not flags, they have to be given one at a time
+    ::madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+    ::madvise(mapping, st.st_size, MADV_WILLNEED);
+
+    ptr = static_cast<const uchar *>(mapping);
+    length = st.st_size;
+    return true;
+}
+
+void mapped_file::close()
+{
+    if (memory)
+        memory.reset();
+    else if (ptr)
+        ::munmap(const_cast<uchar *>(ptr), length);
+    ptr = nullptr;
+    length = 0;
+}
+
+const uchar *mapped_file::data() const
+{
+    return ptr;
+}
+
+size_t mapped_file::size() const
+{
+    return length;
+}
+
+/**
+ * @brief Names a temporary file next to its destination, unique across
+ * threads and processes
+ */
+static std::string make_tmp_path(const std::string &path)
+{
+    static std::atomic<unsigned long> counter(0);
+    return path + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(counter++);
+}
+
+/**
+ * @brief Gives an overwritten file its previous permissions back
+ */
+static void keep_mode(int fd, const std::string &path)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st) == 0)
+        ::fchmod(fd, st.st_mode & 07777);
+}
+
+/**
+ * @brief Writes a buffer next to its destination then renames it over the
+ * destination, readers see either the old or the new file, never a
+ * truncated one. The data is synced before the rename so a crash can't leave
+ * the destination empty. An overwritten file keeps its permissions.
+ *
+ * @param path Destination of the file
+ * @param data Content of the file
+ * @return true If the file was written
+ */
+bool write_file_atomic(const std::string &path, const std::vector<uchar> &data)
+{
+    std::string tmp_path = make_tmp_path(path);
+
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return false;
+
+    const uchar *ptr = data.data();
+    size_t left = data.size();
+    while (left > 0)
+    {
+        ssize_t written = ::write(fd, ptr, left);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+        ptr += written;
+        left -= written;
+    }
+
+    if (left == 0)
+        keep_mode(fd, path);
+
+    bool synced = left == 0 && ::fsync(fd) == 0;
+    if (::close(fd) != 0 || !synced || ::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+    note_output(path);
+    return true;
+}
+
+atomic_file::atomic_file() : file(nullptr) {}
+
+atomic_file::~atomic_file()
+{
+    if (file)
+    {
+        std::fclose(file);
+        ::unlink(tmp_path.c_str());
+    }
+}
+
+/**
+ * @brief Creates the temporary file, for encoders that write as they go
+ *
+ * @param destination Path the file is renamed to on commit
+ * @return true If the temporary file was created
+ */
+bool atomic_file::open(const std::string &destination)
+{
+    path = destination;
+    tmp_path = make_tmp_path(path);
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return false;
+    file = ::fdopen(fd, "wb");
+    if (!file)
+    {
+        ::close(fd);
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+FILE *atomic_file::stream() const
+{
+    return file;
+}
+
+/**
+ * @brief Flushes, syncs and closes the temporary file then renames it over
+ * the destination
+ *
+ * @return true If the destination now holds the new content
+ */
+bool atomic_file::commit()
+{
+    bool success = std::fflush(file) == 0 && !std::ferror(file);
+    if (success)
+    {
+        keep_mode(::fileno(file), path);
+        success = ::fsync(::fileno(file)) == 0;
+    }
+    success = std::fclose(file) == 0 && success;
+    file = nullptr;
+    if (!success || ::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+    note_output(path);
+    return true;
+}
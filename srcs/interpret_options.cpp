@@ -1,5 +1,58 @@
 #include "resize.hpp"
 
+/**
+ * @brief Checks if a target size is valid for its resize method
+ *
+ * @param target Target to check
+ * @return std::string Why the target is invalid, empty if it is valid
+ */
+std::string target_error(const target_spec &target)
+{
+    if (target.method == RESIZE_METHOD::HEIGHT_WIDTH)
+    {
+        if (target.height <= 0)
+            return "Height must be a positive number";
+        if (target.width <= 0)
+            return "Width must be a positive number";
+    }
+    else if (target.method == RESIZE_METHOD::HEIGHT_WIDTH_DYN)
+    {
+        // No values can be under 0, one has to be 0 and the other has to be > 0
+        if (target.height < 0 || target.width < 0)
+            return "Height and width must be positive numbers";
+        if (target.height == 0 && target.width == 0)
+            return "Height and width can't both be 0";
+    }
+    else if (target.method == RESIZE_METHOD::MIN_HEIGHT_WIDTH)
+    {
+        // check that min_height and min_width are valid
+        if (target.min_height <= 0 || target.min_width <= 0)
+            return "min_height and min_width must be positive numbers";
+    }
+    else
+    { // Scale
+        if (!(target.scale > 0.0f))
+            return "Scale must be a positive number";
+    }
+    return "";
+}
+
+/**
+ * @brief Checks if a target size is valid for its resize method, prints
+ * why it isn't
+ *
+ * @param opts Reference to the target
+ * @return true If the target is valid
+ * @return false If the target is invalid
+ */
+bool check_target(const target_spec &opts)
+{
+    std::string error = target_error(opts);
+    if (!error.empty())
+        std::cerr << error << std::endl;
+    return error.empty();
+}
+
 /**
  * @brief Checks if the options are valid
  *
@@ -11,48 +64,33 @@ bool sanity_checks(resize_opts &opts)
 {
     bool error = false;
 
-    if (opts.method == RESIZE_METHOD::HEIGHT_WIDTH)
+    // in server mode jobs may bring their own target
+    bool default_target = !(opts.serve.size() && opts.method == RESIZE_METHOD::SCALE && opts.scale == 0.0f);
+    if (opts.renditions.empty() && default_target)
     {
-        if (opts.height <= 0)
-        {
-            std::cerr << "Height must be a positive number" << std::endl;
-            error = true;
-        }
-        if (opts.width <= 0)
-        {
-            std::cerr << "Width must be a positive number" << std::endl;
-            error = true;
-        }
+        error = !check_target(main_target(opts));
     }
-    else if (opts.method == RESIZE_METHOD::HEIGHT_WIDTH_DYN)
+    else
     {
-        // No values can be under 0, one has to be 0 and the other has to be > 0
-        if (opts.height < 0 || opts.width < 0)
+        std::set<std::string> suffixes;
+        for (auto &rendition : opts.renditions)
         {
-            std::cerr << "Height and width must be positive numbers" << std::endl;
-            error = true;
+            if (!check_target(rendition.target))
+                error = true;
+            if (rendition.suffix.empty() || !suffixes.insert(rendition.suffix).second)
+            {
+                std::cerr << "Each rendition needs its own non-empty suffix" << std::endl;
+                error = true;
+            }
         }
-        if (opts.height == 0 && opts.width == 0)
+        if (opts.pipeline)
         {
-            std::cerr << "Height and width can't both be 0" << std::endl;
+            std::cerr << "Renditions can't be used in pipeline mode" << std::endl;
             error = true;
         }
-    }
-    else if (opts.method == RESIZE_METHOD::MIN_HEIGHT_WIDTH)
-    {
-        // check that min_height and min_width are valid
-        if (opts.min_height <= 0 || opts.min_width <= 0)
+        if (opts.scale != 0.0f || opts.width != 0 || opts.height != 0 || opts.min_width != 0 || opts.min_height != 0)
         {
-            std::cerr << "min_height and min_width must be positive numbers" << std::endl;
-            error = true;
-        }
-    }
-    else
-    { // Scale
-        if (opts.scale <= 0.0f)
-        {
-            std::cerr << "Scale must be a positive number" << std::endl;
-            error = true;
+            std::cerr << "Warning : renditions are set, scale, height and width will be ignored" << std::endl;
         }
     }
 
@@ -68,6 +106,18 @@ bool sanity_checks(resize_opts &opts)
         error = true;
     }
 
+    if (opts.pipeline && (opts.read_threads <= 0 || opts.resize_threads <= 0 || opts.write_threads <= 0))
+    {
+        std::cerr << "Number of threads of each pipeline stage must be a positive number" << std::endl;
+        error = true;
+    }
+
+    if (opts.pipeline && opts.queue_size <= 0)
+    {
+        std::cerr << "Pipeline queue size must be a positive number" << std::endl;
+        error = true;
+    }
+
     if (opts.threads > static_cast<int>(std::thread::hardware_concurrency()))
     {
         std::cerr << "Warning : number of threads is greater than the number of cores" << std::endl;
@@ -79,8 +129,103 @@ bool sanity_checks(resize_opts &opts)
         error = true;
     }
 
+    if (!opts.serve.empty() && (opts.pipeline || opts.dry_run || !opts.renditions.empty() || !opts.manifest.empty()))
+    {
+        std::cerr << "Server mode can't be used with pipeline, dry_run, renditions or manifest" << std::endl;
+        error = true;
+    }
+
+    if (opts.serve == "-" && opts.files_from == "-")
+    {
+        std::cerr << "Server mode and files_from can't both read stdin" << std::endl;
+        error = true;
+    }
+
+    if (!opts.tar_input.empty() && opts.tar_output.empty() && !opts.dry_run)
+    {
+        std::cerr << "tar_input needs a tar_output, archive members can't be written next to their source" << std::endl;
+        error = true;
+    }
+
+    if (!opts.tar_input.empty() && (opts.pipeline || !opts.manifest.empty() || opts.order == ORDER::LARGEST_FIRST))
+    {
+        std::cerr << "tar_input can't be used with pipeline, manifest or order lpt" << std::endl;
+        error = true;
+    }
+
+    // the archive is rewritten on every run, images skipped by the manifest would be dropped from it
+    if (!opts.tar_output.empty() && !opts.manifest.empty())
+    {
+        std::cerr << "tar_output can't be used with manifest" << std::endl;
+        error = true;
+    }
+
+    if ((!opts.tar_input.empty() || !opts.tar_output.empty()) && !opts.serve.empty())
+    {
+        std::cerr << "Server mode can't be used with tar_input or tar_output" << std::endl;
+        error = true;
+    }
+
+    if (opts.tar_input == "-" && opts.files_from == "-")
+    {
+        std::cerr << "tar_input and files_from can't both read stdin" << std::endl;
+        error = true;
+    }
+
+    if ((opts.shard_count > 1 || !opts.shard_claims.empty()) && !opts.serve.empty())
+    {
+        std::cerr << "Server mode can't be used with shard or shard_claims" << std::endl;
+        error = true;
+    }
+
+    if (!opts.shard_claims.empty() && !opts.tar_input.empty())
+    {
+        std::cerr << "shard_claims can't be used with tar_input, other shards' entries aren't kept to be stolen" << std::endl;
+        error = true;
+    }
+
+    // other shards' images are found by reading the inputs a second time
+    if (!opts.shard_claims.empty() && opts.files_from == "-")
+    {
+        std::cerr << "shard_claims can't be used with files_from -, stdin can't be read twice to steal" << std::endl;
+        error = true;
+    }
+
+    if (!opts.shard_claims.empty() && opts.dry_run)
+    {
+        std::cerr << "Warning : shard_claims is ignored in dry run, nothing is claimed" << std::endl;
+        opts.shard_claims.clear();
+    }
+
+    if (!opts.shard_claims.empty() && opts.shard_count <= 1)
+    {
+        std::cerr << "Warning : shard_claims without shard, images are claimed but there is nothing to steal" << std::endl;
+    }
+
+    if (opts.watch && (!opts.serve.empty() || !opts.tar_input.empty() || !opts.shard_claims.empty() || opts.order == ORDER::LARGEST_FIRST))
+    {
+        std::cerr << "watch can't be used with serve, tar_input, shard_claims or order lpt" << std::endl;
+        error = true;
+    }
+
+    if (opts.tar_output == "-")
+    {
+        std::cerr << "tar_output must be a file, stdout carries progress and messages" << std::endl;
+        error = true;
+    }
+
+    if (opts.memory_budget && (opts.pipeline || !opts.serve.empty()))
+    {
+        std::cerr << "Warning : memory_budget has no effect in pipeline or server mode" << std::endl;
+    }
+
+    if (opts.manifest_hash && opts.manifest.empty())
+    {
+        std::cerr << "Warning : manifest_hash has no effect without a manifest" << std::endl;
+    }
+
     // scale is checked before height and width
-    if (opts.method == RESIZE_METHOD::SCALE && opts.height != 0 && opts.width != 0)
+    if (opts.renditions.empty() && opts.method == RESIZE_METHOD::SCALE && opts.height != 0 && opts.width != 0)
     {
         std::cerr << "Warning : height and width will be ignored" << std::endl;
     }
@@ -124,31 +269,218 @@ cv::InterpolationFlags find_interpolation(const std::string &str)
     }
 }
 
-resize_opts interpret_options(po::variables_map &vm)
+const static std::map<std::string, DECODE_SCALING> decode_scaling_map = {
+    {"off", DECODE_SCALING::OFF},
+    {"quality", DECODE_SCALING::QUALITY},
+    {"speed", DECODE_SCALING::SPEED}};
+
+DECODE_SCALING find_decode_scaling(const std::string &str)
+{
+    auto it = decode_scaling_map.find(str);
+    if (it != decode_scaling_map.end())
+    {
+        return it->second;
+    }
+    else
+    {
+        throw std::runtime_error("Invalid decode scaling value, possible values are : off, quality, speed");
+    }
+}
+
+const static std::map<std::string, PARALLELISM> parallelism_map = {
+    {"auto", PARALLELISM::AUTO},
+    {"inter", PARALLELISM::INTER},
+    {"intra", PARALLELISM::INTRA}};
+
+PARALLELISM find_parallelism(const std::string &str)
+{
+    auto it = parallelism_map.find(str);
+    if (it != parallelism_map.end())
+    {
+        return it->second;
+    }
+    else
+    {
+        throw std::runtime_error("Invalid parallelism value, possible values are : auto, inter, intra");
+    }
+}
+
+const static std::map<std::string, ORDER> order_map = {
+    {"discovery", ORDER::DISCOVERY},
+    {"lpt", ORDER::LARGEST_FIRST}};
+
+ORDER find_order(const std::string &str)
+{
+    auto it = order_map.find(str);
+    if (it != order_map.end())
+    {
+        return it->second;
+    }
+    else
+    {
+        throw std::runtime_error("Invalid order value, possible values are : discovery, lpt");
+    }
+}
+
+static int parse_size(const std::string &str)
+{
+    size_t end;
+    int value = std::stoi(str, &end);
+    if (end != str.size())
+        throw std::invalid_argument(str);
+    return value;
+}
+
+/**
+ * @brief Parses a target size, with the same semantics as the resize methods :
+ * "scale:0.5" (SCALE), "512x512" (HEIGHT_WIDTH), "512x" or "x512"
+ * (HEIGHT_WIDTH_DYN) and "min:512x512" (MIN_HEIGHT_WIDTH)
+ *
+ * @param spec Target size
+ * @return target_spec Parsed target, values are not checked
+ */
+target_spec parse_target_spec(const std::string &spec)
+{
+    target_spec target = {RESIZE_METHOD::SCALE, 0.0f, 0, 0, 0, 0};
+
+    try {
+        if (boost::algorithm::starts_with(spec, "scale:"))
+        {
+            size_t end;
+            target.scale = std::stof(spec.substr(6), &end);
+            if (end != spec.size() - 6)
+                throw std::invalid_argument(spec);
+            return target;
+        }
+
+        bool min = boost::algorithm::starts_with(spec, "min:");
+        std::string size = min ? spec.substr(4) : spec;
+        size_t x = size.find('x');
+        if (x == std::string::npos)
+            throw std::invalid_argument(spec);
+        std::string width = size.substr(0, x);
+        std::string height = size.substr(x + 1);
+
+        if (min)
+        {
+            target.min_width = parse_size(width);
+            target.min_height = parse_size(height);
+            target.method = RESIZE_METHOD::MIN_HEIGHT_WIDTH;
+        }
+        else
+        {
+            target.width = width.empty() ? 0 : parse_size(width);
+            target.height = height.empty() ? 0 : parse_size(height);
+            // HEIGHT_WIDTH if both set, HEIGHT_WIDTH_DYN if only one set
+            target.method = (!width.empty() && !height.empty()) ? RESIZE_METHOD::HEIGHT_WIDTH : RESIZE_METHOD::HEIGHT_WIDTH_DYN;
+        }
+    } catch (std::logic_error &e) {
+        throw std::runtime_error("Invalid target size " + spec + ", possible values are : scale:F, WxH, Wx, xH, min:WxH");
+    }
+    return target;
+}
+
+/**
+ * @brief Builds the options used when nothing is passed on the command line,
+ * the resize method still has to be set
+ *
+ * @return resize_opts Default options
+ */
+resize_opts default_options()
 {
     resize_opts opts;
 
+    opts.keep = false;
+    opts.progress = true;
+    opts.recursive = false;
+    opts.verbose = false;
+    opts.delete_fails = true;
+    opts.dry_run = false;
+    opts.generic_resize = false;
+    opts.coef_cache = false;
+    opts.summary = false;
+    opts.schedule_report = false;
+    opts.pipeline = false;
+    opts.manifest_hash = false;
+
+    opts.down_interpolation = cv::INTER_AREA;
+    opts.up_interpolation = cv::INTER_LINEAR;
+    opts.decode_scaling = DECODE_SCALING::QUALITY;
+    opts.parallelism = PARALLELISM::AUTO;
+    opts.intra_threshold = 16000000;
+    opts.pin_threads = false;
+    opts.stream_threshold = 100000000;
+    opts.memory_budget = 0;
+    opts.order = ORDER::DISCOVERY;
+    opts.jpeg_quality = 95;
+    opts.threads = std::thread::hardware_concurrency();
+    opts.read_threads = 2;
+    opts.resize_threads = opts.threads;
+    opts.write_threads = 2;
+    opts.queue_size = 2 * opts.resize_threads;
+    opts.extensions = {"jpg", "jpeg", "png", "webp", "avif"};
+    opts.output_format = "";
+    opts.suffix = "_resized";
+    opts.manifest = "";
+    opts.stats = "";
+    opts.serve = "";
+    opts.files_from = "";
+    opts.tar_input = "";
+    opts.tar_output = "";
+    opts.shard_index = 0;
+    opts.shard_count = 1;
+    opts.shard_claims = "";
+    opts.watch = false;
+
+    opts.method = RESIZE_METHOD::SCALE;
+    opts.scale = 0.0f;
+    opts.height = 0;
+    opts.width = 0;
+    opts.min_height = 0;
+    opts.min_width = 0;
+    return opts;
+}
+
+resize_opts interpret_options(po::variables_map &vm)
+{
+    resize_opts opts = default_options();
+
     opts.keep = vm["keep"].as<bool>();
     opts.progress = vm["progress"].as<bool>();
     opts.recursive = vm["recursive"].as<bool>();
     opts.verbose = vm["verbose"].as<bool>();
     opts.delete_fails = vm["delete_fails"].as<bool>();
     opts.dry_run = vm["dry_run"].as<bool>();
+    opts.generic_resize = vm["generic_resize"].as<bool>();
+    opts.coef_cache = vm["coef_cache"].as<bool>();
     opts.summary = vm["summary"].as<bool>();
+    opts.schedule_report = vm["schedule_report"].as<bool>();
+    opts.pipeline = vm["pipeline"].as<bool>();
+    opts.manifest_hash = vm["manifest_hash"].as<bool>();
+    opts.pin_threads = vm["pin_threads"].as<bool>();
+    opts.watch = vm["watch"].as<bool>();
 
-    if (opts.verbose || opts.dry_run)
+    // a run that never ends has no progress to show
+    if (opts.verbose || opts.dry_run || opts.watch)
         opts.progress = false;
 
-    // Options with default values
-    opts.down_interpolation = cv::INTER_AREA;
-    opts.up_interpolation = cv::INTER_LINEAR;
-    opts.jpeg_quality = 95;
-    opts.threads = std::thread::hardware_concurrency();
-    opts.extensions = {"jpg", "jpeg", "png", "webp", "avif"};
-    opts.output_format = "";
-    opts.suffix = "_resized";
+    // Interpret renditions option (if any), each one is "target:suffix"
+    if (vm.count("renditions"))
+    {
+        std::vector<std::string> specs;
+        boost::split(specs, vm["renditions"].as<std::string>(), boost::is_any_of(" "), boost::token_compress_on);
+        for (auto &spec : specs)
+        {
+            if (spec.empty())
+                continue;
+            size_t colon = spec.find_last_of(':');
+            if (colon == std::string::npos)
+                throw std::runtime_error("Invalid rendition " + spec + ", expected target:suffix");
+            opts.renditions.push_back({parse_target_spec(spec.substr(0, colon)), spec.substr(colon + 1)});
+        }
+    }
 
-    // Compulsory options
+    // Compulsory options, unless renditions are set
     if (vm.count("scale"))
     {
         opts.scale = vm["scale"].as<float>();
@@ -173,8 +505,8 @@ resize_opts interpret_options(po::variables_map &vm)
         opts.min_width = vm["min_width"].as<int>();
         opts.method = RESIZE_METHOD::MIN_HEIGHT_WIDTH;
     }
-    else
-        throw std::runtime_error("Either scale or height or width or min_height and min_width must be specified");
+    else if (opts.renditions.empty() && !vm.count("serve"))
+        throw std::runtime_error("Either scale or height or width or min_height and min_width or renditions must be specified");
 
     // Interpret interpolation options (if any) (lowercase)
     if (vm.count("down_interpolation"))
@@ -191,6 +523,54 @@ resize_opts interpret_options(po::variables_map &vm)
         opts.up_interpolation = find_interpolation(_up_interpolation_str);
     }
 
+    // Interpret decode scaling option (if any) (lowercase)
+    if (vm.count("decode_scaling"))
+    {
+        std::string _decode_scaling_str = vm["decode_scaling"].as<std::string>();
+        boost::algorithm::to_lower(_decode_scaling_str);
+        opts.decode_scaling = find_decode_scaling(_decode_scaling_str);
+    }
+
+    // Interpret parallelism options (if any) (lowercase)
+    if (vm.count("parallelism"))
+    {
+        std::string _parallelism_str = vm["parallelism"].as<std::string>();
+        boost::algorithm::to_lower(_parallelism_str);
+        opts.parallelism = find_parallelism(_parallelism_str);
+    }
+
+    // Interpret order option (if any) (lowercase)
+    if (vm.count("order"))
+    {
+        std::string _order_str = vm["order"].as<std::string>();
+        boost::algorithm::to_lower(_order_str);
+        opts.order = find_order(_order_str);
+    }
+
+    if (vm.count("intra_threshold"))
+    {
+        float megapixels = vm["intra_threshold"].as<float>();
+        if (megapixels <= 0.0f)
+            throw std::runtime_error("intra_threshold must be a positive number of megapixels");
+        opts.intra_threshold = static_cast<uint64_t>(megapixels * 1e6);
+    }
+
+    if (vm.count("memory_budget"))
+    {
+        float megabytes = vm["memory_budget"].as<float>();
+        if (megabytes < 0.0f)
+            throw std::runtime_error("memory_budget must be a number of megabytes, 0 for no limit");
+        opts.memory_budget = static_cast<uint64_t>(megabytes * 1e6);
+    }
+
+    if (vm.count("stream_threshold"))
+    {
+        float megapixels = vm["stream_threshold"].as<float>();
+        if (megapixels < 0.0f)
+            throw std::runtime_error("stream_threshold must be a number of megapixels, 0 to disable streaming");
+        opts.stream_threshold = static_cast<uint64_t>(megapixels * 1e6);
+    }
+
     // Interpret jpeg quality option (if any)
     if (vm.count("jpeg_quality"))
     {
@@ -203,6 +583,12 @@ resize_opts interpret_options(po::variables_map &vm)
         opts.threads = vm["threads"].as<int>();
     }
 
+    // Interpret pipeline stage options (if any), resize stage defaults to all threads
+    opts.read_threads = vm.count("read_threads") ? vm["read_threads"].as<int>() : 2;
+    opts.resize_threads = vm.count("resize_threads") ? vm["resize_threads"].as<int>() : opts.threads;
+    opts.write_threads = vm.count("write_threads") ? vm["write_threads"].as<int>() : 2;
+    opts.queue_size = vm.count("queue_size") ? vm["queue_size"].as<int>() : 2 * opts.resize_threads;
+
     // Interpret extensions option (if any)
     if (vm.count("extensions"))
     {
@@ -221,6 +607,64 @@ resize_opts interpret_options(po::variables_map &vm)
         opts.suffix = vm["suffix"].as<std::string>();
     }
 
+    // Interpret manifest option (if any)
+    if (vm.count("manifest"))
+    {
+        opts.manifest = vm["manifest"].as<std::string>();
+    }
+
+    // Interpret stats option (if any)
+    if (vm.count("stats"))
+    {
+        opts.stats = vm["stats"].as<std::string>();
+    }
+
+    // Interpret files_from option (if any)
+    if (vm.count("files_from"))
+    {
+        opts.files_from = vm["files_from"].as<std::string>();
+    }
+
+    // Interpret tar options (if any), archive members don't exist on disk so they are never deleted
+    if (vm.count("tar_input"))
+    {
+        opts.tar_input = vm["tar_input"].as<std::string>();
+        opts.delete_fails = false;
+    }
+    if (vm.count("tar_output"))
+    {
+        opts.tar_output = vm["tar_output"].as<std::string>();
+    }
+
+    // Interpret shard options (if any), K/N with 0 <= K < N
+    if (vm.count("shard"))
+    {
+        std::string shard = vm["shard"].as<std::string>();
+        size_t slash = shard.find('/');
+        try {
+            if (slash == std::string::npos)
+                throw std::invalid_argument(shard);
+            opts.shard_index = parse_size(shard.substr(0, slash));
+            opts.shard_count = parse_size(shard.substr(slash + 1));
+        } catch (std::logic_error &e) {
+            throw std::runtime_error("Invalid shard " + shard + ", expected K/N");
+        }
+        if (opts.shard_count < 1 || opts.shard_index < 0 || opts.shard_index >= opts.shard_count)
+            throw std::runtime_error("Invalid shard " + shard + ", K must be between 0 and N - 1");
+    }
+    if (vm.count("shard_claims"))
+    {
+        opts.shard_claims = vm["shard_claims"].as<std::string>();
+    }
+
+    // Interpret serve option (if any), a server never deletes its clients' files
+    if (vm.count("serve"))
+    {
+        opts.serve = vm["serve"].as<std::string>();
+        opts.progress = false;
+        opts.delete_fails = false;
+    }
+
     if (!sanity_checks(opts))
     {
         throw std::runtime_error("Invalid options were passed");
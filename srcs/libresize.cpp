@@ -0,0 +1,228 @@
+#include "resize.hpp"
+#include "libresize.hpp"
+
+/*
+ * libresize maps its options onto resize_opts and runs the same probe,
+ * reduced decode, resize and encode steps as the command, on buffers
+ * instead of files. Nothing is printed and no file is ever touched.
+ */
+
+static bool valid_target(const target_spec &target)
+{
+    switch (target.method)
+    {
+    case RESIZE_METHOD::SCALE:
+        return target.scale > 0.0f;
+    case RESIZE_METHOD::HEIGHT_WIDTH:
+        return target.width > 0 && target.height > 0;
+    case RESIZE_METHOD::HEIGHT_WIDTH_DYN:
+        return target.width >= 0 && target.height >= 0 && (target.width > 0 || target.height > 0);
+    case RESIZE_METHOD::MIN_HEIGHT_WIDTH:
+        return target.min_width > 0 && target.min_height > 0;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Builds the command line options equivalent to library options
+ *
+ * @return false If the options are invalid
+ */
+static bool make_opts(const libresize_options &options, resize_opts &opts, target_spec &target)
+{
+    opts = default_options();
+    opts.progress = false;
+    opts.verbose = false;
+    opts.delete_fails = false;
+    opts.down_interpolation = options.down_interpolation;
+    opts.up_interpolation = options.up_interpolation;
+    opts.decode_scaling = options.decode_scaling ? DECODE_SCALING::QUALITY : DECODE_SCALING::OFF;
+    opts.jpeg_quality = options.jpeg_quality;
+    if (opts.jpeg_quality < 0 || opts.jpeg_quality > 100)
+        return false;
+
+    try {
+        target = parse_target_spec(options.target);
+    } catch (std::runtime_error &e) {
+        return false;
+    }
+    return valid_target(target);
+}
+
+/**
+ * @brief Finds the extension OpenCV encodes to
+ *
+ * @param format Requested format, empty to keep the input format
+ * @param input Format of the input image
+ * @param extension Filled with the extension, with its dot
+ * @return false If the format is unknown or unsupported
+ */
+static bool find_extension(const std::string &format, IMAGE_FORMAT input, std::string &extension)
+{
+    static const std::set<std::string> supported = {"jpg", "jpeg", "png", "webp", "avif"};
+    static const std::map<IMAGE_FORMAT, std::string> input_extensions = {
+        {IMAGE_FORMAT::JPEG, "jpg"}, {IMAGE_FORMAT::PNG, "png"}, {IMAGE_FORMAT::WEBP, "webp"}, {IMAGE_FORMAT::AVIF, "avif"}};
+
+    std::string ext = boost::algorithm::to_lower_copy(format);
+    if (ext.empty())
+    {
+        auto it = input_extensions.find(input);
+        if (it == input_extensions.end())
+            return false;
+        ext = it->second;
+    }
+    if (!supported.count(ext))
+        return false;
+    extension = "." + ext;
+    return true;
+}
+
+/**
+ * @brief Calculates the target size of an image, as the command would
+ */
+static LIBRESIZE_STATUS target_size(const target_spec &target, int cols, int rows, int &width, int &height)
+{
+    if (compute_target_size(target, cols, rows, width, height) != RESIZE_STATUS::RESIZE)
+        return LIBRESIZE_STATUS::SKIPPED;
+    return (width > 0 && height > 0) ? LIBRESIZE_STATUS::OK : LIBRESIZE_STATUS::INVALID_OPTIONS;
+}
+
+/**
+ * @brief Encodes an image, output is only replaced on success
+ */
+static LIBRESIZE_STATUS encode(resize_opts &opts, const std::string &extension, const cv::Mat &image, std::vector<uchar> &output)
+{
+    thread_local std::vector<uchar> buffer;
+
+    try {
+        stage_timer timer(STAGE::ENCODE);
+        if (!cv::imencode(extension, image, buffer, {cv::IMWRITE_JPEG_QUALITY, opts.jpeg_quality}))
+            return LIBRESIZE_STATUS::ENCODE_FAILED;
+    } catch (cv::Exception &e) {
+        return LIBRESIZE_STATUS::ENCODE_FAILED;
+    }
+    output.assign(buffer.begin(), buffer.end());
+    return LIBRESIZE_STATUS::OK;
+}
+
+LIBRESIZE_STATUS libresize_target_size(const libresize_options &options, int cols, int rows, int &width, int &height)
+{
+    resize_opts opts;
+    target_spec target;
+    if (!make_opts(options, opts, target) || cols <= 0 || rows <= 0)
+        return LIBRESIZE_STATUS::INVALID_OPTIONS;
+    return target_size(target, cols, rows, width, height);
+}
+
+LIBRESIZE_STATUS libresize_mat(const libresize_options &options, const cv::Mat &src, cv::Mat &dst)
+{
+    resize_opts opts;
+    target_spec target;
+    int width, height;
+    if (!make_opts(options, opts, target))
+        return LIBRESIZE_STATUS::INVALID_OPTIONS;
+    if (src.empty())
+        return LIBRESIZE_STATUS::DECODE_FAILED;
+
+    LIBRESIZE_STATUS status = target_size(target, src.cols, src.rows, width, height);
+    if (status != LIBRESIZE_STATUS::OK)
+        return status;
+    cv::Mat resized;
+    if (!resize_image(opts, "", src, resized, width, height))
+        return LIBRESIZE_STATUS::RESIZE_FAILED;
+    dst = resized;
+    return LIBRESIZE_STATUS::OK;
+}
+
+LIBRESIZE_STATUS libresize_mat(const libresize_options &options, const cv::Mat &src, std::vector<uchar> &output)
+{
+    resize_opts opts;
+    target_spec target;
+    std::string extension;
+    int width, height;
+    if (!make_opts(options, opts, target) || options.format.empty() || !find_extension(options.format, IMAGE_FORMAT::UNKNOWN, extension))
+        return LIBRESIZE_STATUS::INVALID_OPTIONS;
+    if (src.empty())
+        return LIBRESIZE_STATUS::DECODE_FAILED;
+
+    LIBRESIZE_STATUS status = target_size(target, src.cols, src.rows, width, height);
+    if (status != LIBRESIZE_STATUS::OK)
+        return status;
+    cv::Mat resized = pooled_mat(POOL_RESIZE, cv::Size(width, height), src.type());
+    if (!resize_image(opts, "", src, resized, width, height))
+        return LIBRESIZE_STATUS::RESIZE_FAILED;
+    return encode(opts, extension, resized, output);
+}
+
+LIBRESIZE_STATUS libresize_buffer(const libresize_options &options, const uchar *data, size_t size, std::vector<uchar> &output)
+{
+    resize_opts opts;
+    target_spec target;
+    image_info info;
+    std::string extension;
+    int width = 0, height = 0;
+    if (!make_opts(options, opts, target))
+        return LIBRESIZE_STATUS::INVALID_OPTIONS;
+
+    // the header gives the target before decoding, so JPEGs can be decoded reduced
+    int flags = cv::IMREAD_UNCHANGED;
+    cv::Mat image;
+    if (probe_buffer(data, size, info))
+    {
+        LIBRESIZE_STATUS status = target_size(target, info.width, info.height, width, height);
+        if (status != LIBRESIZE_STATUS::OK)
+            return status;
+        flags = reduced_decode_flag(opts, info, cv::Size(width, height));
+
+        int type;
+        cv::Size predicted = predict_decoded_size(info, flags, type);
+        if (!predicted.empty())
+            image = pooled_mat(POOL_DECODE, predicted, type);
+    }
+    else
+        info = image_info();
+
+    try {
+        stage_timer timer(STAGE::DECODE);
+        if (cv::imdecode(cv::Mat(1, size, CV_8UC1, const_cast<uchar *>(data)), flags, &image).empty())
+            return LIBRESIZE_STATUS::DECODE_FAILED;
+    } catch (cv::Exception &e) {
+        return LIBRESIZE_STATUS::DECODE_FAILED;
+    }
+    // formats OpenCV decodes but the probe doesn't know need an explicit output format
+    if (!find_extension(options.format, info.format, extension))
+        return LIBRESIZE_STATUS::INVALID_OPTIONS;
+    if (info.format == IMAGE_FORMAT::UNKNOWN)
+    {
+        LIBRESIZE_STATUS status = target_size(target, image.cols, image.rows, width, height);
+        if (status != LIBRESIZE_STATUS::OK)
+            return status;
+    }
+
+    cv::Mat resized = pooled_mat(POOL_RESIZE, cv::Size(width, height), image.type());
+    if (!resize_image(opts, "", image, resized, width, height))
+        return LIBRESIZE_STATUS::RESIZE_FAILED;
+    return encode(opts, extension, resized, output);
+}
+
+const char *libresize_status_string(LIBRESIZE_STATUS status)
+{
+    switch (status)
+    {
+    case LIBRESIZE_STATUS::OK:
+        return "ok";
+    case LIBRESIZE_STATUS::SKIPPED:
+        return "skipped";
+    case LIBRESIZE_STATUS::INVALID_OPTIONS:
+        return "invalid options";
+    case LIBRESIZE_STATUS::DECODE_FAILED:
+        return "decode failed";
+    case LIBRESIZE_STATUS::RESIZE_FAILED:
+        return "resize failed";
+    case LIBRESIZE_STATUS::ENCODE_FAILED:
+        return "encode failed";
+    default:
+        return "unknown";
+    }
+}
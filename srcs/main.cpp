@@ -14,18 +14,44 @@ int main(int argc, char **argv)
         ("delete_fails", po::bool_switch()->default_value(true), "delete files that failed to resize (default: true)")
         ("dry_run", po::bool_switch()->default_value(false), "dry run (default: false), just prints what would be done")
         ("summary", po::bool_switch()->default_value(false), "print details of the resize operation and exits")
+        ("schedule_report", po::bool_switch()->default_value(false), "print how busy each worker thread was (default: false)")
         ("width", po::value<int>(), "width of the resized image")
         ("height", po::value<int>(),"height of the resized image")
         ("min_width", po::value<int>(), "resizes just over the closest width, keeping aspect ratio (min_height must be set)")
         ("min_height", po::value<int>(), "resizes just over the closest height keeping aspect ratio (min_width must be set)")
         ("scale", po::value<float>(),"scale of the resized image")
+        ("renditions", po::value<std::string>(), "decode once and write several sizes, as target:suffix (space separated), target being scale:F, WxH, Wx, xH or min:WxH")
+        ("generic_resize", po::bool_switch()->default_value(false), "always resize with OpenCV, even exact integer INTER_AREA downscales (default: false)")
+        ("coef_cache", po::bool_switch()->default_value(false), "resize with a separable resampler whose coefficient tables are shared by images of the same size (default: false)")
         ("down_interpolation", po::value<std::string>(), "interpolation method for downscaling (default: INTER_AREA)")
         ("up_interpolation", po::value<std::string>(), "interpolation method for upscaling (default: INTER_LINEAR)")
+        ("decode_scaling", po::value<std::string>(), "decode JPEGs at 1/2, 1/4 or 1/8 size when the target is small enough : off, quality, speed (default: quality)")
+        ("parallelism", po::value<std::string>(), "how cores are shared : inter (one image per core), intra (every core on one image), auto (intra above intra_threshold once fewer images than threads are queued) (default: auto)")
+        ("intra_threshold", po::value<float>(), "megapixels from which auto parallelism gives an image every core (default: 16)")
+        ("pin_threads", po::bool_switch()->default_value(false), "pin each worker thread to a CPU (default: false)")
+        ("order", po::value<std::string>(), "order images are processed in : discovery (as found), lpt (largest first, probed once discovery ends) (default: discovery)")
+        ("memory_budget", po::value<float>(), "megabytes of decoded and resized images in flight at once, larger images wait while smaller ones run, 0 for no limit (default: 0)")
+        ("stream_threshold", po::value<float>(), "megapixels from which PNGs and JPEGs are downscaled in row bands instead of decoded whole, 0 to disable (default: 100)")
         ("jpeg_quality", po::value<int>(), "jpeg quality (default: 95)")
         ("threads", po::value<int>(), "number of threads to use (default: all available)")
+        ("pipeline", po::bool_switch()->default_value(false), "overlap reading, resizing and writing in separate stages (default: false)")
+        ("read_threads", po::value<int>(), "number of reader threads in pipeline mode (default: 2)")
+        ("resize_threads", po::value<int>(), "number of resize threads in pipeline mode (default: threads)")
+        ("write_threads", po::value<int>(), "number of writer threads in pipeline mode (default: 2)")
+        ("queue_size", po::value<int>(), "images buffered between pipeline stages (default: 2 * resize_threads)")
         ("extensions", po::value<std::string>(), "extensions to consider (default: jpg jpeg png webp avif) (space separated)")
         ("output_format", po::value<std::string>(), "output format (default: same as input)")
         ("suffix", po::value<std::string>(), "suffix to append to the filename (default: _resized)")
+        ("manifest", po::value<std::string>(), "skip files left unchanged since they were processed with the same options, and record processed files in this file")
+        ("manifest_hash", po::bool_switch()->default_value(false), "also compare content hashes of files whose mtime changed (default: false)")
+        ("stats", po::value<std::string>(), "time each stage and write a JSON report to this file, - only prints the timings")
+        ("serve", po::value<std::string>(), "run as a server, reading JSON jobs from this Unix socket, or stdin if -, one JSON answer per job")
+        ("files_from", po::value<std::string>(), "also resize the files listed in this file, or stdin if -, one path per line or NUL separated (find -print0)")
+        ("tar_input", po::value<std::string>(), "also resize the images of this tar archive, or stdin if -, read sequentially and never unpacked (needs tar_output)")
+        ("tar_output", po::value<std::string>(), "write every output into this tar archive instead of one file each, members are named after the output paths, rewritten whole on every run (not with manifest)")
+        ("shard", po::value<std::string>(), "only resize the images of shard K out of N (K/N, K from 0 to N - 1), assigned by a hash of their path, every shard must be given the same input paths")
+        ("shard_claims", po::value<std::string>(), "claim each image in this shared directory before resizing it, and once done with its own shard resize the images other shards haven't claimed yet")
+        ("watch", po::bool_switch()->default_value(false), "after the first pass, keep resizing images as they are written into the input directories, until interrupted (default: false)")
         ("files", po::value<std::vector<std::string>>(), "files to resize")
     ;
 
@@ -44,7 +70,7 @@ int main(int argc, char **argv)
         return (1);
     }
 
-    if (vm.count("help") || !vm.count("files"))
+    if (vm.count("help") || (!vm.count("files") && !vm.count("files_from") && !vm.count("tar_input") && !vm.count("serve")))
     {
         std::cout << desc << std::endl;
         return (0);
@@ -63,58 +89,222 @@ int main(int argc, char **argv)
 
     if (opts.summary)
     {
-        print_summary(opts, vm["files"].as<std::vector<std::string>>());
+        print_summary(opts, vm.count("files") ? vm["files"].as<std::vector<std::string>>() : std::vector<std::string>());
         return (0);
     }
 
-    // we're using sets to just skip duplicates and not do any extra work
-    std::set<std::string> files;
+    if (!opts.stats.empty())
+        stats_enable();
 
-    // print files passed as arguments
-    for (auto &file : vm["files"].as<std::vector<std::string>>())
+    try {
+        manifest_load(opts);
+    } catch (std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+        return (1);
+    }
+
+    if (!opts.serve.empty())
     {
-        if (opts.verbose)
-            std::cout << "Processing : " << file << std::endl;
-        fill_set(files, opts, file);
+        // workers stay warm between jobs until the server stops
+        scheduler sched(opts.threads);
+        std::vector<std::thread> threads;
+        parallelism_init(opts, sched);
+        for (int i = 0; i < opts.threads; i++)
+        {
+            threads.push_back(std::thread(process_queue, std::ref(opts), std::ref(sched), i));
+            if (opts.pin_threads)
+                pin_thread(threads.back(), i);
+        }
+        auto start = std::chrono::steady_clock::now();
+        int ret = serve(opts, sched);
+        sched.close();
+        for (auto &thread : threads)
+            thread.join();
+        if (!opts.stats.empty())
+            print_stats(opts, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        return (ret);
     }
 
-    size_t total = files.size();
-    if (opts.verbose)
-        std::cout << "Found " << total << " files to process" << std::endl;
+    static const std::vector<std::string> no_inputs;
+    const std::vector<std::string> &inputs = vm.count("files") ? vm["files"].as<std::vector<std::string>>() : no_inputs;
+    int ret = 0;
+    std::atomic<size_t> total(0);
 
-    // if we're using only one thread, just process the files
-    if (opts.threads == 1)
+    if (!opts.tar_output.empty() && !opts.dry_run && !tar_output_open(opts))
+        return (1);
+    // directories are watched before the first pass so nothing written meanwhile is missed
+    if (opts.watch && !watch_start(inputs))
+        return (1);
+    if (!opts.shard_claims.empty())
     {
-        for (auto &file : files)
+        boost::system::error_code error;
+        boost::filesystem::create_directories(opts.shard_claims, error);
+        if (error)
         {
-            process_image(opts, file);
-            if (opts.progress)
-                update_progress_bar(total);
+            std::cerr << "Failed to create " << opts.shard_claims << ": " << error.message() << std::endl;
+            return (1);
         }
     }
+
+    // workers start right away and process files as the walk finds them
+    scheduler sched(opts.pipeline ? opts.read_threads : opts.threads);
+    auto start = std::chrono::steady_clock::now();
+    progress_start(opts, total);
+    std::vector<std::thread> threads;
+    parallelism_init(opts, sched);
+    memory_budget_init(opts);
+    if (opts.pipeline)
+    {
+        threads.push_back(std::thread(run_pipeline, std::ref(opts), std::ref(sched)));
+    }
     else
     {
-        std::vector<std::vector<std::string>> chunks;
-        chunks.resize(opts.threads);
-        unsigned int i = 0;
-        for (auto it = files.begin(); it != files.end(); ++it)
+        for (int i = 0; i < opts.threads; i++)
         {
-            chunks[i % opts.threads].push_back(*it);
-            i++;
+            threads.push_back(std::thread(process_queue, std::ref(opts), std::ref(sched), i));
+            if (opts.pin_threads)
+                pin_thread(threads.back(), i);
         }
-        files.clear(); // clear the set to save memory
-        // process chunks
-        std::vector<std::thread> threads;
-        for (auto &chunk : chunks)
+    }
+
+    // the same file can only be found twice through overlapping input paths, largest first holds them back until discovery ends
+    duplicate_filter duplicates(inputs.size() > 1);
+    std::vector<std::string> held;
+    // workers write into the inputs while they are walked, their outputs aren't sources
+    output_tracking(true);
+    auto found = [&](const std::string &path) {
+        watch_note_found(path);
+        if (!shard_owns(opts, path) || written_by_run(path))
+            return;
+        total++;
+        if (opts.order == ORDER::LARGEST_FIRST)
+            held.push_back(path);
+        else
+            sched.push({path, nullptr});
+    };
+    {
+        stage_timer timer(STAGE::DISCOVER);
+        for (auto &file : inputs)
         {
-            threads.push_back(std::thread(process_chunk, std::ref(opts), std::ref(chunk), std::ref(total)));
+            if (opts.verbose)
+                std::cout << "Processing : " << file << std::endl;
+            discover_files(opts, file, duplicates, found);
         }
-        for (auto &thread : threads)
+        // listed files are queued as they are read, never more than a few per worker
+        if (!opts.files_from.empty())
         {
-            thread.join();
+            size_t backlog = 64 * sched.workers();
+            bool read = read_file_list(opts, opts.files_from, [&](const std::string &path) {
+                if (opts.order == ORDER::DISCOVERY)
+                    sched.wait_below(backlog);
+                found(path);
+            });
+            ret = read ? 0 : 1;
+        }
+        // archive members are held in memory, the backlog bounds how many at once
+        if (!opts.tar_input.empty())
+        {
+            size_t backlog = 64 * sched.workers();
+            bool read = read_tar(opts, opts.tar_input, [&](const std::string &path) {
+                sched.wait_below(backlog);
+                found(path);
+            });
+            ret |= read ? 0 : 1;
+        }
+    }
+    auto discovered = std::chrono::steady_clock::now();
+    auto queued = discovered;
+    if (opts.order == ORDER::LARGEST_FIRST)
+    {
+        order_largest_first(opts, held);
+        if (opts.verbose)
+            std::cout << "Ordered " << held.size() << " files largest first in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - queued).count() << "s" << std::endl;
+        queued = std::chrono::steady_clock::now();
+        for (auto &path : held)
+            sched.push({path, nullptr});
+    }
+    size_t directories = discovered_directory_count();
+    // other shards' images are found again by a second walk rather than kept
+    // from the first one, memory stays bounded however large the job
+    if (!opts.shard_claims.empty())
+    {
+        sched.wait_below(1);
+        if (opts.verbose)
+            std::cout << "Shard queued out, walking the inputs again for images of other shards" << std::endl;
+        size_t backlog = 64 * sched.workers();
+        auto steal = [&](const std::string &path) {
+            if (shard_owns(opts, path) || written_by_run(path))
+                return; // queued by the first walk, or an output of this node, other nodes claimed theirs
+            sched.wait_below(backlog);
+            total++;
+            sched.push({path, nullptr});
+        };
+        duplicate_filter again(inputs.size() > 1);
+        for (auto &file : inputs)
+            discover_files(opts, file, again, steal);
+        if (!opts.files_from.empty())
+            read_file_list(opts, opts.files_from, steal);
+    }
+    output_tracking(false);
+    if (opts.watch)
+    {
+        watch_run(opts, inputs, [&](const std::string &path) {
+            if (!shard_owns(opts, path))
+                return;
+            total++;
+            sched.push({path, nullptr});
+        });
+    }
+    sched.close();
+    progress_discovery_done();
+
+    if (opts.verbose)
+    {
+        double seconds = std::chrono::duration<double>(discovered - start).count();
+        std::cout << "Found " << total << " files to process in " << directories << " directories ("
+                  << seconds << "s, " << static_cast<size_t>(total / std::max(seconds, 1e-6)) << " files/s)" << std::endl;
+    }
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double makespan = std::chrono::duration<double>(std::chrono::steady_clock::now() - queued).count();
+    progress_stop();
+    if (!tar_output_close(opts))
+        ret = 1;
+
+    if (opts.schedule_report)
+    {
+        print_schedule_report(sched, elapsed);
+        if (opts.order == ORDER::LARGEST_FIRST && !opts.pipeline)
+            print_makespan_report(sched, makespan);
+    }
+    if (!opts.stats.empty())
+        print_stats(opts, elapsed);
+    else if (opts.verbose)
+    {
+        pool_counters pools = get_pool_counters();
+        std::cout << "Gave every core to " << parallelism_exclusive_count() << " large images" << std::endl;
+        std::cout << "Reused buffers for " << pools.reused << " allocations (" << pools.reused_bytes / 1000000 << " MB)" << std::endl;
+        if (!opts.shard_claims.empty())
+        {
+            std::cout << "Claimed " << shard_claims_won() << " images, " << shard_claims_lost()
+                      << " were claimed by other shards" << std::endl;
+        }
+        if (opts.coef_cache)
+        {
+            coef_cache_counters coefs = get_coef_cache_counters();
+            std::cout << "Found resize coefficients cached for " << coefs.hits << " of " << coefs.hits + coefs.misses
+                      << " resizes (" << coefs.entries << " geometries cached)" << std::endl;
+        }
+        if (opts.memory_budget)
+        {
+            std::cout << "Deferred " << memory_budget_deferred_count() << " images for memory, at most "
+                      << memory_budget_peak() / 1000000 << " MB in flight" << std::endl;
         }
     }
-    std::cerr << std::endl;
 
-    return (0);
+    return (ret);
 }
\ No newline at end of file
@@ -0,0 +1,197 @@
+#include "resize.hpp"
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <sys/stat.h>
+
+/*
+ * The manifest is an append-only text file, one record per processed file :
+ * <settings hash> <size> <mtime in ns> <content hash> <path>
+ * separated by tabs. The last record of a path wins, records written with
+ * other settings are ignored. Deleting the file forces a full run.
+ */
+
+struct manifest_entry
+{
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t hash; // 0 when content hashing is disabled
+};
+
+static std::mutex mtx;
+static std::ofstream output;
+static std::unordered_map<uint64_t, manifest_entry> entries; // keyed by path hash
+static uint64_t settings_hash = 0;
+
+/**
+ * @brief 64 bit FNV-1a hash, shared with the shard assignment
+ *
+ * @param data Bytes to hash
+ * @param size Number of bytes
+ * @param hash Offset basis, or the hash of the preceding bytes
+ */
+uint64_t fnv1a(const void *data, size_t size, uint64_t hash)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_string(const std::string &str)
+{
+    return fnv1a(str.data(), str.size());
+}
+
+static bool hash_file(const std::string &path, uint64_t &hash)
+{
+    std::ifstream file(path, std::ios::binary);
+    char buffer[1 << 16];
+
+    hash = 0xcbf29ce484222325ULL;
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+        hash = fnv1a(buffer, file.gcount(), hash);
+    return !file.bad() && file.eof();
+}
+
+static bool stat_file(const std::string &path, manifest_entry &entry)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+        return false;
+    entry.size = st.st_size;
+    entry.mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ULL + st.st_mtim.tv_nsec;
+    entry.hash = 0;
+    return true;
+}
+
+/**
+ * @brief Appends a record and makes it the current state of the path
+ *
+ * @param path Path to the source image
+ * @param entry Size, mtime and content hash to record
+ */
+static void write_record(const std::string &path, const manifest_entry &entry)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    entries[hash_string(path)] = entry;
+    output << std::hex << settings_hash << '\t' << std::dec << entry.size << '\t' << entry.mtime << '\t'
+           << std::hex << entry.hash << std::dec << '\t' << path << '\n' << std::flush;
+}
+
+/**
+ * @brief Hashes every option that changes the output of a run
+ */
+static uint64_t hash_settings(resize_opts &opts)
+{
+    std::ostringstream ss;
+    ss << static_cast<int>(opts.method) << ' ' << opts.scale << ' ' << opts.width << ' ' << opts.height << ' '
+       << opts.min_width << ' ' << opts.min_height << ' ' << opts.down_interpolation << ' ' << opts.up_interpolation << ' '
+       << static_cast<int>(opts.decode_scaling) << ' ' << opts.jpeg_quality << ' ' << opts.output_format << ' '
+       << opts.keep << ' ' << opts.suffix << ' ' << opts.tar_output << ' ' << opts.coef_cache << ' ' << opts.stream_threshold;
+    for (auto &rendition : opts.renditions)
+    {
+        const target_spec &target = rendition.target;
+        ss << ' ' << static_cast<int>(target.method) << ' ' << target.scale << ' ' << target.width << ' ' << target.height << ' '
+           << target.min_width << ' ' << target.min_height << ' ' << rendition.suffix;
+    }
+    return hash_string(ss.str());
+}
+
+/**
+ * @brief Reads the records of the manifest matching the current settings and
+ * opens it for appending
+ *
+ * @param opts Reference to command line options
+ */
+void manifest_load(resize_opts &opts)
+{
+    if (opts.manifest.empty())
+        return;
+
+    settings_hash = hash_settings(opts);
+
+    std::ifstream input(opts.manifest);
+    std::string line;
+    while (std::getline(input, line))
+    {
+        std::istringstream record(line);
+        uint64_t settings;
+        manifest_entry entry;
+        std::string path;
+        record >> std::hex >> settings >> std::dec >> entry.size >> entry.mtime >> std::hex >> entry.hash;
+        if (!record || record.get() != '\t' || !std::getline(record, path))
+            continue; // truncated by a crash, ignore it
+        if (settings == settings_hash)
+            entries[hash_string(path)] = entry;
+    }
+
+    output.open(opts.manifest, std::ios::app);
+    if (!output)
+        throw std::runtime_error("Failed to open manifest " + opts.manifest);
+    if (opts.verbose)
+        std::cout << "Loaded " << entries.size() << " manifest records matching the current options" << std::endl;
+}
+
+/**
+ * @brief Checks whether a file was processed with the current settings and
+ * hasn't changed since, only stats the file (or hashes it when its mtime
+ * changed and content hashing is enabled)
+ *
+ * @param opts Reference to command line options
+ * @param path Path to the image
+ * @return true If the file can be skipped
+ */
+bool manifest_unchanged(resize_opts &opts, const std::string &path)
+{
+    if (opts.manifest.empty())
+        return false;
+
+    manifest_entry current;
+    if (!stat_file(path, current))
+        return false;
+
+    manifest_entry previous;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.find(hash_string(path));
+        if (it == entries.end())
+            return false;
+        previous = it->second;
+    }
+
+    if (current.size != previous.size)
+        return false;
+    if (current.mtime == previous.mtime)
+        return true;
+    // touched but maybe not modified, the content hash tells
+    if (!opts.manifest_hash || previous.hash == 0 || !hash_file(path, current.hash) || current.hash != previous.hash)
+        return false;
+    // the hash was just computed, record the new mtime without reading the file again
+    if (!opts.dry_run)
+        write_record(path, current);
+    return true;
+}
+
+/**
+ * @brief Appends a record for a file that was processed successfully
+ *
+ * @param opts Reference to command line options
+ * @param path Path to the source image
+ */
+void manifest_record(resize_opts &opts, const std::string &path)
+{
+    if (opts.manifest.empty() || opts.dry_run)
+        return;
+
+    // when overwriting the source, this is the state of the resized file
+    manifest_entry entry;
+    if (!stat_file(path, entry))
+        return;
+    if (opts.manifest_hash && !hash_file(path, entry.hash))
+        entry.hash = 0;
+    write_record(path, entry);
+}
@@ -0,0 +1,129 @@
+#include "resize.hpp"
+
+/*
+ * Admission control for --memory_budget: before decoding, a worker reserves
+ * the decoded and resized size of its image, estimated from the header.
+ * When the reservation doesn't fit the image is deferred and the worker
+ * moves on, the scheduler hands deferred images out again as soon as they
+ * fit. An image is always admitted when nothing else is in flight, so an
+ * image larger than the whole budget still runs, alone.
+ */
+
+static std::mutex mtx;
+static std::condition_variable released;
+static uint64_t budget = 0; // 0 admits everything
+static uint64_t in_use = 0;
+static uint64_t peak = 0;
+static std::atomic<size_t> deferred_images(0);
+
+static bool fits(uint64_t bytes)
+{
+    return in_use == 0 || in_use + bytes <= budget;
+}
+
+/**
+ * @brief Sets the budget shared by every worker, before any worker starts
+ *
+ * @param opts Reference to command line options
+ */
+void memory_budget_init(const resize_opts &opts)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    budget = (opts.pipeline || !opts.serve.empty()) ? 0 : opts.memory_budget;
+}
+
+/**
+ * @brief Checks whether a reservation would currently be admitted
+ *
+ * @param bytes Size of the reservation
+ */
+bool memory_budget_fits(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return budget == 0 || fits(bytes);
+}
+
+/**
+ * @brief Estimates the memory an image holds while it is processed, from its
+ * header: the decoded image and every output, encoded buffers aside
+ *
+ * @param opts Reference to command line options
+ * @param info Header of the image
+ * @param target Size the image is decoded for
+ * @param outputs Sizes of the resized images
+ * @return uint64_t Estimate in bytes, 0 if the header doesn't tell
+ */
+uint64_t estimate_image_memory(resize_opts &opts, const image_info &info, const cv::Size &target, const std::vector<cv::Size> &outputs)
+{
+    // a source row and three rows of 64 bit accumulators
+    if (outputs.size() == 1 && stream_eligible(opts, info, target))
+        return static_cast<uint64_t>(info.width) * 8 + static_cast<uint64_t>(target.width) * 4 * 8 * 3;
+
+    int type;
+    cv::Size decoded = predict_decoded_size(info, reduced_decode_flag(opts, info, target), type);
+    if (decoded.empty())
+        return 0;
+    uint64_t pixels = static_cast<uint64_t>(decoded.width) * decoded.height;
+    for (auto &size : outputs)
+        pixels += static_cast<uint64_t>(size.width) * size.height;
+    return pixels * CV_ELEM_SIZE(type);
+}
+
+/**
+ * @brief Number of images deferred for lack of memory
+ */
+size_t memory_budget_deferred_count()
+{
+    return deferred_images;
+}
+
+/**
+ * @brief Highest amount of memory reserved at once, in bytes
+ */
+uint64_t memory_budget_peak()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return peak;
+}
+
+memory_reservation::memory_reservation() : bytes(0) {}
+
+memory_reservation::~memory_reservation()
+{
+    if (!bytes)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        in_use -= bytes;
+    }
+    released.notify_all();
+}
+
+/**
+ * @brief Reserves the memory of a task, or defers the task when it doesn't
+ * fit. A task that was already deferred once waits for room instead.
+ *
+ * @param t Task being processed, t.memory is set when it is deferred
+ * @param size Estimated memory of the task in bytes
+ * @return true If the task may run
+ * @return false If the task must go back to the scheduler
+ */
+bool memory_reservation::admit(task &t, uint64_t size)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    if (budget == 0 || size == 0)
+        return true;
+
+    if (t.memory)
+        released.wait(lock, [size] { return fits(size); });
+    else if (!fits(size))
+    {
+        t.memory = size;
+        deferred_images++;
+        return false;
+    }
+    bytes = size;
+    in_use += bytes;
+    peak = std::max(peak, in_use);
+    return true;
+}
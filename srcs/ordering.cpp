@@ -0,0 +1,133 @@
+#include "resize.hpp"
+#include <iomanip>
+#include <queue>
+#include <sstream>
+
+/*
+ * Largest processing time first: once discovery is over, every image is
+ * probed and queued from the most expensive to the cheapest, so the last
+ * images to start are the short ones and no large image runs alone at the
+ * end. The cost of an image is the pixels it is decoded to plus the pixels
+ * it is resized to, both known from its header.
+ */
+
+static std::vector<uint64_t> discovery_costs; // in discovery order
+static std::vector<uint64_t> ordered_costs;   // in queue order
+
+/**
+ * @brief Estimates the work of an image from its header
+ *
+ * @return uint64_t Decoded plus resized pixels, 0 if the header is unknown or
+ * the image will be skipped
+ */
+static uint64_t image_cost(resize_opts &opts, const std::string &path)
+{
+    image_info info;
+    int width, height;
+    if (!probe_image(path, info))
+        return 0;
+    if (compute_target_size(opts, info.width, info.height, width, height) != RESIZE_STATUS::RESIZE)
+        return 0;
+
+    int type;
+    cv::Size decoded = predict_decoded_size(info, reduced_decode_flag(opts, info, cv::Size(width, height)), type);
+    if (decoded.empty())
+        decoded = cv::Size(info.width, info.height);
+    return static_cast<uint64_t>(decoded.width) * decoded.height + static_cast<uint64_t>(std::max(width, 0)) * std::max(height, 0);
+}
+
+/**
+ * @brief Sorts paths from the most to the least expensive image, headers are
+ * probed on every thread
+ *
+ * @param opts Reference to command line options
+ * @param paths Paths in discovery order, sorted in place
+ */
+void order_largest_first(resize_opts &opts, std::vector<std::string> &paths)
+{
+    std::vector<uint64_t> costs(paths.size());
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < opts.threads; i++)
+    {
+        threads.push_back(std::thread([&] {
+            for (size_t j = next++; j < paths.size(); j = next++)
+                costs[j] = image_cost(opts, paths[j]);
+        }));
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    // ties keep their discovery order
+    std::vector<size_t> order(paths.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return costs[a] > costs[b]; });
+
+    std::vector<std::string> sorted;
+    sorted.reserve(paths.size());
+    ordered_costs.clear();
+    for (size_t i : order)
+    {
+        sorted.push_back(std::move(paths[i]));
+        ordered_costs.push_back(costs[i]);
+    }
+    paths.swap(sorted);
+    discovery_costs.swap(costs);
+}
+
+/**
+ * @brief Makespan of list scheduling, each job going to the first free worker
+ *
+ * @param costs Job costs, in queue order
+ * @param workers Number of workers
+ * @return uint64_t Cost of the most loaded worker
+ */
+static uint64_t list_makespan(const std::vector<uint64_t> &costs, int workers)
+{
+    std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t>> loads;
+    for (int i = 0; i < workers; i++)
+        loads.push(0);
+    uint64_t makespan = 0;
+    for (uint64_t cost : costs)
+    {
+        uint64_t load = loads.top() + cost;
+        loads.pop();
+        loads.push(load);
+        makespan = std::max(makespan, load);
+    }
+    return makespan;
+}
+
+/**
+ * @brief Prints the makespan predicted from the probed costs next to the one
+ * measured, the cost to seconds rate is calibrated on the run itself
+ *
+ * @param sched Scheduler the images ran on
+ * @param elapsed Seconds from the first queued image to the last finished one
+ */
+void print_makespan_report(const scheduler &sched, double elapsed)
+{
+    uint64_t total = 0;
+    uint64_t largest = 0;
+    double busy = 0.0;
+    for (uint64_t cost : ordered_costs)
+    {
+        total += cost;
+        largest = std::max(largest, cost);
+    }
+    for (auto &stats : sched.stats())
+        busy += stats.busy;
+    if (total == 0)
+        return;
+
+    int workers = sched.workers();
+    double seconds_per_unit = busy / total;
+    double bound = std::max(static_cast<double>(total) / workers, static_cast<double>(largest)) * seconds_per_unit;
+    std::ostringstream report;
+    report << std::setprecision(3) << std::fixed
+           << "\tMakespan: predicted " << list_makespan(ordered_costs, workers) * seconds_per_unit << "s largest first ("
+           << list_makespan(discovery_costs, workers) * seconds_per_unit << "s in discovery order, lower bound "
+           << bound << "s), actual " << elapsed << "s" << std::endl;
+    std::cerr << report.str();
+}
@@ -0,0 +1,116 @@
+#include "resize.hpp"
+#include <pthread.h>
+
+/*
+ * Workers share a gate: small images enter it shared and run on their
+ * worker alone, with OpenCV's own pool disabled, while a large image waits
+ * for the gate to empty, enters it alone and lets OpenCV spread its resize
+ * and box filter over every core. A waiting large image stops new small
+ * ones from entering, so it is never starved. Decoding and encoding stay
+ * single-threaded, so under the auto policy a large image only goes alone
+ * when fewer images are queued than there are workers, the few huge images
+ * left at the end of a run or in a small directory; before that, images of
+ * every size keep one core each busy.
+ */
+
+static std::mutex mtx;
+static std::condition_variable changed;
+static int shared_holders = 0;
+static int exclusive_waiting = 0;
+static bool exclusive_held = false;
+static std::atomic<size_t> exclusive_images(0);
+static scheduler *queue = nullptr; // backlog checked by the auto policy
+
+/**
+ * @brief Sets OpenCV's thread count for the policy, before any worker starts
+ *
+ * @param opts Reference to command line options
+ * @param sched Scheduler the workers take their images from
+ */
+void parallelism_init(const resize_opts &opts, scheduler &sched)
+{
+    queue = &sched;
+    if (opts.pipeline)
+        return; // stages have their own thread counts, OpenCV keeps its default
+    cv::setNumThreads((opts.parallelism == PARALLELISM::INTRA) ? opts.threads : 1);
+}
+
+/**
+ * @brief Enters the gate for one image, exclusively if the image should use
+ * every core
+ *
+ * @param opts Reference to command line options
+ * @param pixels Pixel count of the decoded image, 0 if unknown
+ */
+parallel_scope::parallel_scope(const resize_opts &opts, uint64_t pixels) : opts(opts), active(!opts.pipeline)
+{
+    if (!active)
+        return;
+    exclusive = opts.parallelism == PARALLELISM::INTRA
+        || (opts.parallelism == PARALLELISM::AUTO && pixels >= opts.intra_threshold
+            && queue && queue->queued() < static_cast<size_t>(queue->workers()));
+
+    std::unique_lock<std::mutex> lock(mtx);
+    if (exclusive)
+    {
+        exclusive_waiting++;
+        changed.wait(lock, [] { return !exclusive_held && shared_holders == 0; });
+        exclusive_waiting--;
+        exclusive_held = true;
+        exclusive_images++;
+    }
+    else
+    {
+        changed.wait(lock, [] { return !exclusive_held && exclusive_waiting == 0; });
+        shared_holders++;
+    }
+    lock.unlock();
+
+    if (exclusive && opts.parallelism == PARALLELISM::AUTO)
+        cv::setNumThreads(opts.threads);
+}
+
+parallel_scope::~parallel_scope()
+{
+    if (!active)
+        return;
+    if (exclusive && opts.parallelism == PARALLELISM::AUTO)
+        cv::setNumThreads(1);
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (exclusive)
+            exclusive_held = false;
+        else
+            shared_holders--;
+    }
+    changed.notify_all();
+}
+
+/**
+ * @brief Number of images that ran alone with every core
+ */
+size_t parallelism_exclusive_count()
+{
+    return exclusive_images;
+}
+
+/**
+ * @brief Pins a worker thread to one CPU, workers are spread round-robin
+ *
+ * @param thread Worker thread
+ * @param worker Index of the worker
+ */
+void pin_thread(std::thread &thread, int worker)
+{
+    int cpus = std::thread::hardware_concurrency();
+    if (cpus <= 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker % cpus, &set);
+    int ret = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+    if (ret != 0)
+        std::cerr << "Failed to pin worker " << worker << ": " << std::strerror(ret) << std::endl;
+}
@@ -0,0 +1,150 @@
+#include "resize.hpp"
+
+struct pipeline_item
+{
+    std::string path;
+    std::string output_path;
+    cv::Mat image;
+    int width;
+    int height;
+};
+
+/**
+ * @brief Shared state of a pipelined run, each stage closes the queue it
+ * feeds once its last thread returns
+ */
+struct pipeline
+{
+    pipeline(size_t queue_size, int readers, int resizers)
+        : to_resize(queue_size), to_write(queue_size), readers(readers), resizers(resizers) {}
+
+    bounded_queue<pipeline_item> to_resize;
+    bounded_queue<pipeline_item> to_write;
+    std::mutex mtx;
+    int readers;  // reader threads still running
+    int resizers; // resize threads still running
+};
+
+/**
+ * @brief Opens an image and computes its target size
+ *
+ * @return true If the image has to go through the resize and writer stages
+ */
+static bool read_item(resize_opts &opts, pipeline_item &item)
+{
+    image_info info;
+    cv::Size target;
+    cv::Size source;
+
+    if (!shard_claim(opts, item.path))
+    {
+        if (opts.verbose)
+            std::cerr << "Skipping " << item.path << " (claimed by another shard)" << std::endl;
+        return false;
+    }
+    if (manifest_unchanged(opts, item.path))
+    {
+        if (opts.verbose)
+            std::cerr << "Skipping " << item.path << " (unchanged since last run)" << std::endl;
+        return false;
+    }
+    if (skip_from_header(opts, item.path, info, target))
+    {
+        manifest_record(opts, item.path);
+        return false;
+    }
+    if (!decode_image(opts, item.path, info, target, item.image, source, false))
+        return false;
+
+    RESIZE_STATUS status = compute_target_size(opts, source.width, source.height, item.width, item.height);
+    if (status != RESIZE_STATUS::RESIZE)
+    {
+        report_skip(opts, item.path, status, source.width, source.height);
+        manifest_record(opts, item.path);
+        return false;
+    }
+    item.output_path = make_output_path(opts, item.path);
+    return true;
+}
+
+/**
+ * @brief Reader stage, feeds the resize stage
+ */
+static void read_stage(resize_opts &opts, scheduler &sched, pipeline &pipe, int worker)
+{
+    task t;
+    while (sched.pop(worker, t))
+    {
+        pipeline_item item;
+        item.path = std::move(t.path);
+        if (read_item(opts, item))
+            pipe.to_resize.push(std::move(item));
+        else
+            progress_image_done();
+    }
+
+    std::lock_guard<std::mutex> lock(pipe.mtx);
+    if (--pipe.readers == 0)
+        pipe.to_resize.close();
+}
+
+/**
+ * @brief Resize stage, CPU bound
+ */
+static void resize_stage(resize_opts &opts, pipeline &pipe)
+{
+    pipeline_item item;
+    while (pipe.to_resize.pop(item))
+    {
+        if (!resize_image(opts, item.path, item.image, item.image, item.width, item.height))
+        {
+            progress_image_done();
+            continue;
+        }
+        pipe.to_write.push(std::move(item));
+    }
+
+    std::lock_guard<std::mutex> lock(pipe.mtx);
+    if (--pipe.resizers == 0)
+        pipe.to_write.close();
+}
+
+/**
+ * @brief Writer stage, encodes and writes the resized images
+ */
+static void write_stage(resize_opts &opts, pipeline &pipe)
+{
+    pipeline_item item;
+    while (pipe.to_write.pop(item))
+    {
+        if (write_image(opts, item.path, item.output_path, item.image))
+            manifest_record(opts, item.path);
+        item.image.release(); // free the pixels before blocking on the queue
+        progress_image_done();
+    }
+}
+
+/**
+ * @brief Runs the reader, resize and writer stages concurrently, joined by
+ * bounded queues so slow storage and CPU work overlap
+ *
+ * @param opts Reference to command line options
+ * @param sched Scheduler feeding the reader threads, one worker per reader
+ */
+void run_pipeline(resize_opts &opts, scheduler &sched)
+{
+    pipeline pipe(opts.queue_size, opts.read_threads, opts.resize_threads);
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < opts.read_threads; i++)
+        threads.push_back(std::thread(read_stage, std::ref(opts), std::ref(sched), std::ref(pipe), i));
+    for (int i = 0; i < opts.resize_threads; i++)
+        threads.push_back(std::thread(resize_stage, std::ref(opts), std::ref(pipe)));
+    for (int i = 0; i < opts.write_threads; i++)
+        threads.push_back(std::thread(write_stage, std::ref(opts), std::ref(pipe)));
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+}
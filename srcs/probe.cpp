@@ -0,0 +1,319 @@
+#include "resize.hpp"
+#include <fstream>
+#include <cstring>
+
+static int read_u8(std::istream &file)
+{
+    return file.get(); // EOF is -1, callers check file.good()
+}
+
+static int read_u16_be(std::istream &file)
+{
+    int hi = file.get();
+    int lo = file.get();
+    return (hi << 8) | lo;
+}
+
+static uint32_t get_u32_be(const unsigned char *p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static uint32_t get_u24_le(const unsigned char *p)
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16);
+}
+
+static uint32_t get_u32_le(const unsigned char *p)
+{
+    return get_u24_le(p) | (uint32_t(p[3]) << 24);
+}
+
+/**
+ * @brief Reads the frame header of a JPEG, walking the marker segments up to
+ * the first SOFn marker
+ */
+static bool probe_jpeg(std::istream &file, image_info &info)
+{
+    file.seekg(2); // skip SOI
+    while (file.good())
+    {
+        if (read_u8(file) != 0xFF)
+            return false;
+        int marker = read_u8(file);
+        while (marker == 0xFF) // fill bytes
+            marker = read_u8(file);
+
+        // standalone markers have no length
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+            continue;
+        if (marker == 0xD9 || marker == 0xDA) // EOI / SOS before any frame header
+            return false;
+
+        int length = read_u16_be(file);
+        if (length < 2)
+            return false;
+
+        // SOF0 to SOF15, except DHT, JPG and DAC which share the range
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+        {
+            info.depth = read_u8(file);
+            info.height = read_u16_be(file);
+            info.width = read_u16_be(file);
+            info.channels = read_u8(file);
+            info.format = IMAGE_FORMAT::JPEG;
+            return file.good() && info.width > 0 && info.height > 0;
+        }
+        file.seekg(length - 2, std::ios::cur);
+    }
+    return false;
+}
+
+/**
+ * @brief Reads the IHDR chunk of a PNG, always the first chunk after the signature
+ */
+static bool probe_png(std::istream &file, image_info &info)
+{
+    static const int channels[] = {1, 0, 3, 3, 2, 0, 4}; // by color type, palette entries are RGB
+    unsigned char ihdr[8 + 13];
+
+    file.seekg(8);
+    if (!file.read(reinterpret_cast<char *>(ihdr), sizeof(ihdr)) || std::memcmp(ihdr + 4, "IHDR", 4) != 0)
+        return false;
+    int color_type = ihdr[17];
+    if (color_type > 6 || channels[color_type] == 0)
+        return false;
+    info.format = IMAGE_FORMAT::PNG;
+    info.width = get_u32_be(ihdr + 8);
+    info.height = get_u32_be(ihdr + 12);
+    info.depth = ihdr[16];
+    info.channels = channels[color_type];
+    return info.width > 0 && info.height > 0;
+}
+
+/**
+ * @brief Reads the first chunk of a WebP, which is either a lossy (VP8),
+ * lossless (VP8L) or extended (VP8X) header
+ */
+static bool probe_webp(std::istream &file, image_info &info)
+{
+    unsigned char chunk[8 + 10];
+
+    file.seekg(12); // skip the RIFF header
+    if (!file.read(reinterpret_cast<char *>(chunk), sizeof(chunk)))
+        return false;
+    const unsigned char *data = chunk + 8;
+
+    info.format = IMAGE_FORMAT::WEBP;
+    info.depth = 8;
+    info.channels = 3;
+    if (std::memcmp(chunk, "VP8 ", 4) == 0)
+    {
+        // 3 bytes frame tag, 3 bytes start code then 14 bits width and height
+        if (data[3] != 0x9D || data[4] != 0x01 || data[5] != 0x2A)
+            return false;
+        info.width = (data[6] | (data[7] << 8)) & 0x3FFF;
+        info.height = (data[8] | (data[9] << 8)) & 0x3FFF;
+    }
+    else if (std::memcmp(chunk, "VP8L", 4) == 0)
+    {
+        // signature byte, then 14 bits width - 1, 14 bits height - 1 and the alpha bit
+        if (data[0] != 0x2F)
+            return false;
+        uint32_t bits = get_u32_le(data + 1);
+        info.width = (bits & 0x3FFF) + 1;
+        info.height = ((bits >> 14) & 0x3FFF) + 1;
+        info.channels = ((bits >> 28) & 1) ? 4 : 3;
+    }
+    else if (std::memcmp(chunk, "VP8X", 4) == 0)
+    {
+        // flags, 3 reserved bytes, then 24 bits canvas width - 1 and height - 1
+        info.width = get_u24_le(data + 4) + 1;
+        info.height = get_u24_le(data + 7) + 1;
+        info.channels = (data[0] & 0x10) ? 4 : 3;
+    }
+    else
+        return false;
+    return info.width > 0 && info.height > 0;
+}
+
+/**
+ * @brief Finds a box in an ISO BMFF buffer
+ *
+ * @param data Start of the boxes
+ * @param size Size of the buffer
+ * @param type Four character code of the box
+ * @param box Filled with the content of the box
+ * @param box_size Filled with the size of the content
+ * @return true If the box was found
+ */
+static bool find_box(const unsigned char *data, size_t size, const char *type, const unsigned char *&box, size_t &box_size)
+{
+    size_t offset = 0;
+    while (offset + 8 <= size)
+    {
+        size_t length = get_u32_be(data + offset);
+        if (length < 8 || offset + length > size)
+            return false; // 64 bits and open ended boxes never hold metadata
+        if (std::memcmp(data + offset + 4, type, 4) == 0)
+        {
+            box = data + offset + 8;
+            box_size = length - 8;
+            return true;
+        }
+        offset += length;
+    }
+    return false;
+}
+
+/**
+ * @brief Reads the image spatial extents (ispe) property of an AVIF, the
+ * largest one is the primary image, smaller ones belong to thumbnails
+ */
+static bool probe_avif(std::istream &file, image_info &info)
+{
+    const size_t max_meta_size = 1 << 20;
+    unsigned char header[16];
+
+    // the meta box follows ftyp at the top level
+    file.seekg(0);
+    while (file.read(reinterpret_cast<char *>(header), 8))
+    {
+        uint64_t length = get_u32_be(header);
+        if (length == 1)
+        {
+            if (!file.read(reinterpret_cast<char *>(header + 8), 8))
+                return false;
+            length = (uint64_t(get_u32_be(header + 8)) << 32) | get_u32_be(header + 12);
+            length -= 8;
+        }
+        if (length < 8)
+            return false;
+
+        if (std::memcmp(header + 4, "meta", 4) != 0)
+        {
+            file.seekg(length - 8, std::ios::cur);
+            continue;
+        }
+        if (length - 8 > max_meta_size)
+            return false;
+
+        std::vector<unsigned char> meta(length - 8);
+        if (!file.read(reinterpret_cast<char *>(meta.data()), meta.size()) || meta.size() < 4)
+            return false;
+
+        // meta is a full box, skip version and flags
+        const unsigned char *iprp, *ipco;
+        size_t iprp_size, ipco_size;
+        if (!find_box(meta.data() + 4, meta.size() - 4, "iprp", iprp, iprp_size) || !find_box(iprp, iprp_size, "ipco", ipco, ipco_size))
+            return false;
+
+        size_t offset = 0;
+        while (offset + 8 <= ipco_size)
+        {
+            size_t property = get_u32_be(ipco + offset);
+            if (property < 8 || offset + property > ipco_size)
+                break;
+            const unsigned char *data = ipco + offset + 8;
+            if (std::memcmp(ipco + offset + 4, "ispe", 4) == 0 && property >= 8 + 12)
+            {
+                int width = get_u32_be(data + 4);
+                int height = get_u32_be(data + 8);
+                if (static_cast<int64_t>(width) * height > static_cast<int64_t>(info.width) * info.height)
+                {
+                    info.width = width;
+                    info.height = height;
+                }
+            }
+            else if (std::memcmp(ipco + offset + 4, "pixi", 4) == 0 && property >= 8 + 6 && info.channels == 0)
+            {
+                info.channels = data[4];
+                info.depth = data[5];
+            }
+            offset += property;
+        }
+        info.format = IMAGE_FORMAT::AVIF;
+        return info.width > 0 && info.height > 0;
+    }
+    return false;
+}
+
+/**
+ * @brief Read-only stream over a buffer, seekable like a file
+ */
+class memory_streambuf : public std::streambuf
+{
+public:
+    memory_streambuf(const uchar *data, size_t size)
+    {
+        char *begin = reinterpret_cast<char *>(const_cast<uchar *>(data));
+        setg(begin, begin, begin + size);
+    }
+
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override
+    {
+        off_type base = (dir == std::ios_base::beg) ? 0 : (dir == std::ios_base::cur) ? gptr() - eback() : egptr() - eback();
+        if (base + off < 0 || base + off > egptr() - eback())
+            return pos_type(off_type(-1));
+        setg(eback(), eback() + base + off, egptr());
+        return pos_type(base + off);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode mode) override
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, mode);
+    }
+};
+
+static bool probe_stream(std::istream &file, image_info &info)
+{
+    unsigned char magic[12];
+    file.read(reinterpret_cast<char *>(magic), sizeof(magic));
+    if (!file)
+        return false;
+
+    info = image_info();
+    if (magic[0] == 0xFF && magic[1] == 0xD8)
+        return probe_jpeg(file, info);
+    if (std::memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0)
+        return probe_png(file, info);
+    if (std::memcmp(magic, "RIFF", 4) == 0 && std::memcmp(magic + 8, "WEBP", 4) == 0)
+        return probe_webp(file, info);
+    if (std::memcmp(magic + 4, "ftyp", 4) == 0)
+        return probe_avif(file, info);
+    return false;
+}
+
+/**
+ * @brief Reads the size of an image from its header, without decoding it
+ *
+ * @param path Path to the image
+ * @param info Filled with the format, size and layout of the image
+ * @return true If the header was recognized
+ */
+bool probe_image(const std::string &path, image_info &info)
+{
+    stage_timer timer(STAGE::PROBE);
+    if (auto memory = memory_file_find(path))
+        return probe_buffer(memory->data(), memory->size(), info);
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    return probe_stream(file, info);
+}
+
+/**
+ * @brief Reads the size of an encoded image in memory, without decoding it
+ *
+ * @param data Encoded image
+ * @param size Size of the encoded image in bytes
+ * @param info Filled with the format, size and layout of the image
+ * @return true If the header was recognized
+ */
+bool probe_buffer(const uchar *data, size_t size, image_info &info)
+{
+    memory_streambuf buffer(data, size);
+    std::istream stream(&buffer);
+    return probe_stream(stream, info);
+}
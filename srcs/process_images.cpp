@@ -1,118 +1,283 @@
 #include <resize.hpp>
-#include <iomanip>
+#include <sstream>
+#include <cstring>
 
-static std::mutex mtx; // to avoid data races
-static size_t progress = 0;
+static std::mutex mtx; // to avoid interleaved dry run output
 
-void update_progress_bar(size_t &total)
+/**
+ * @brief Per-thread dry run output, written in one block when it grows large
+ * and when the thread exits
+ */
+struct output_buffer
 {
-    mtx.lock();
-    progress++;
-    // print a fancy progress bar
-    std::cerr << "\r[";
-    for (size_t i = 0; i < 50; i++)
+    std::string text;
+
+    void flush()
     {
-        if (i < (progress * 50) / total)
-            std::cerr << "=";
-        else
-            std::cerr << " ";
+        std::lock_guard<std::mutex> lock(mtx);
+        std::cout << text << std::flush;
+        text.clear();
     }
-    std::cerr << "] " << std::setprecision(2) << std::fixed << (progress * 100) / total << "%" << std::flush;
-    mtx.unlock();
-}
+
+    ~output_buffer()
+    {
+        if (!text.empty())
+            flush();
+    }
+};
 
 void dry_run_print(const std::string &path, int &width, int &height, bool noop, const std::string &output_path)
 {
-    mtx.lock();
+    thread_local output_buffer buffer;
+    std::ostringstream line;
+
     if (noop)
-        std::cout << "[NO-OP] " << path << " is already at the correct size (" << width << "x" << height << ")" << std::endl;
+        line << "[NO-OP] " << path << " is already at the correct size (" << width << "x" << height << ")" << std::endl;
     else
-        std::cout << "[RESIZE] " << path << " -> " << output_path << " (" << width << "x" << height << ")" << std::endl;
-    mtx.unlock();
+        line << "[RESIZE] " << path << " -> " << output_path << " (" << width << "x" << height << ")" << std::endl;
+    buffer.text += line.str();
+    if (buffer.text.size() >= (1 << 16))
+        buffer.flush();
 }
 
 /**
- * @brief Processes an image
- * 
+ * @brief Picks the largest JPEG DCT scaling (1/2, 1/4 or 1/8) that keeps the
+ * decoded image over the target size, the final resize does the rest
+ *
+ * @param opts Reference to command line options
+ * @param info Header of the image
+ * @param target Largest size the image will be resized to, empty if unknown
+ * @return int cv::imread flags, cv::IMREAD_UNCHANGED to decode at full size
+ */
+int reduced_decode_flag(resize_opts &opts, const image_info &info, const cv::Size &target)
+{
+    static const int reduced_gray[] = {cv::IMREAD_REDUCED_GRAYSCALE_8, cv::IMREAD_REDUCED_GRAYSCALE_4, cv::IMREAD_REDUCED_GRAYSCALE_2};
+    static const int reduced_color[] = {cv::IMREAD_REDUCED_COLOR_8, cv::IMREAD_REDUCED_COLOR_4, cv::IMREAD_REDUCED_COLOR_2};
+
+    // only the JPEG decoder skips work, the other codecs decode at full size and resize afterwards
+    if (opts.decode_scaling == DECODE_SCALING::OFF || info.format != IMAGE_FORMAT::JPEG || info.depth != 8)
+        return cv::IMREAD_UNCHANGED;
+    // reduced modes decode to gray or BGR, only use them when IMREAD_UNCHANGED would give the same layout
+    if (info.channels != 1 && info.channels != 3)
+        return cv::IMREAD_UNCHANGED;
+
+    if (target.width <= 0 || target.height <= 0)
+        return cv::IMREAD_UNCHANGED;
+
+    int margin = (opts.decode_scaling == DECODE_SCALING::QUALITY) ? 2 : 1;
+    for (int i = 0, scale = 8; scale > 1; i++, scale /= 2)
+    {
+        // libjpeg rounds the scaled size up
+        int cols = (info.width + scale - 1) / scale;
+        int rows = (info.height + scale - 1) / scale;
+        if (cols >= target.width * margin && rows >= target.height * margin)
+        {
+            // IMREAD_UNCHANGED ignores the EXIF orientation, so must the reduced decode
+            return ((info.channels == 1) ? reduced_gray[i] : reduced_color[i]) | cv::IMREAD_IGNORE_ORIENTATION;
+        }
+    }
+    return cv::IMREAD_UNCHANGED;
+}
+
+/**
+ * @brief Gets the JPEG DCT scaling denominator of reduced decode flags
+ *
+ * @param flags Flags returned by reduced_decode_flag
+ * @return int 1, 2, 4 or 8
+ */
+int reduced_decode_scale(int flags)
+{
+    if (flags == cv::IMREAD_UNCHANGED)
+        return 1;
+    return (flags & cv::IMREAD_REDUCED_GRAYSCALE_8) ? 8 : (flags & cv::IMREAD_REDUCED_GRAYSCALE_4) ? 4 : 2;
+}
+
+/**
+ * @brief Predicts how many pixels an image is decoded to, after any reduced
+ * decode
+ *
+ * @param opts Reference to command line options
+ * @param info Header of the image
+ * @param target Size the image is resized to
+ * @return uint64_t Decoded pixels, 0 if unknown
+ */
+uint64_t decoded_pixels(resize_opts &opts, const image_info &info, const cv::Size &target)
+{
+    int type;
+    cv::Size decoded = predict_decoded_size(info, reduced_decode_flag(opts, info, target), type);
+    if (decoded.empty())
+        decoded = cv::Size(info.width, info.height);
+    return static_cast<uint64_t>(decoded.width) * decoded.height;
+}
+
+/**
+ * @brief Opens an image, failures are reported and handled according to the options
+ *
  * @param opts Reference to command line options
  * @param path Path to the image
+ * @param info Header of the image, format is IMAGE_FORMAT::UNKNOWN if it couldn't be probed
+ * @param target Largest size the image will be resized to, empty if unknown
+ * @param image Filled with the decoded image, may be smaller than the source
+ * @param source Filled with the size of the source image
+ * @param pooled Decode into the thread's buffer pool, the image must then
+ * not leave the calling thread
+ * @return true If the image was decoded
  */
-void process_image(resize_opts &opts, const std::string & path)
+bool decode_image(resize_opts &opts, const std::string &path, const image_info &info, const cv::Size &target, cv::Mat &image, cv::Size &source, bool pooled)
 {
-    // open the image
-    cv::Mat image = cv::imread(path, cv::IMREAD_UNCHANGED);
+    int flags = reduced_decode_flag(opts, info, target);
+    mapped_file file;
+    const uchar *pool_data = nullptr;
+
+    if (pooled)
+    {
+        int type;
+        cv::Size size = predict_decoded_size(info, flags, type);
+        if (!size.empty())
+        {
+            image = pooled_mat(POOL_DECODE, size, type);
+            pool_data = image.data;
+        }
+    }
+    if (file.open(path))
+    {
+        stage_timer timer(STAGE::DECODE);
+        try {
+            // imdecode reuses image when the guessed size and type are right
+            if (cv::imdecode(cv::Mat(1, file.size(), CV_8UC1, const_cast<uchar *>(file.data())), flags, &image).empty())
+                image.release();
+        } catch (cv::Exception &e) {
+            image.release();
+        }
+    }
+    else
+        image.release();
     if (image.empty())
     {
         if (opts.verbose)
             std::cerr << "Failed to open " << path << std::endl;
         if (opts.delete_fails)
             std::remove(path.c_str());
-        return;
+        return false;
     }
+    if (pool_data && image.data != pool_data)
+        pool_count_mispredicted();
+    source = (flags == cv::IMREAD_UNCHANGED) ? image.size() : cv::Size(info.width, info.height);
+    progress_add_bytes(file.size());
+    stats_add_bytes(file.size(), 0);
+    return true;
+}
 
-    int width, height;
+/**
+ * @brief Calculates the size an image should be resized to
+ *
+ * @param target Target size and resize method
+ * @param cols Width of the source image
+ * @param rows Height of the source image
+ * @param width Filled with the target width
+ * @param height Filled with the target height
+ * @return RESIZE_STATUS::RESIZE if the image has to be resized
+ */
+RESIZE_STATUS compute_target_size(const target_spec &target, int cols, int rows, int &width, int &height)
+{
     // calculate the new size using scale or width and height
-    if (opts.method == RESIZE_METHOD::SCALE)
+    if (target.method == RESIZE_METHOD::SCALE)
     {
-        width = image.cols * opts.scale;
-        height = image.rows * opts.scale;
+        width = cols * target.scale;
+        height = rows * target.scale;
     }
-    else if (opts.method == RESIZE_METHOD::HEIGHT_WIDTH)
+    else if (target.method == RESIZE_METHOD::HEIGHT_WIDTH)
     {
-        width = opts.width;
-        height = opts.height;
+        width = target.width;
+        height = target.height;
     }
-    else if (opts.method == RESIZE_METHOD::HEIGHT_WIDTH_DYN)
+    else if (target.method == RESIZE_METHOD::HEIGHT_WIDTH_DYN)
     {
-        float ratio = (float)image.cols / (float)image.rows;
-        width = (opts.width != 0) ? opts.width : opts.height * ratio;
-        height = (opts.height != 0) ? opts.height : opts.width / ratio;
+        float ratio = (float)cols / (float)rows;
+        width = (target.width != 0) ? target.width : target.height * ratio;
+        height = (target.height != 0) ? target.height : target.width / ratio;
     }
-    else if (opts.method == RESIZE_METHOD::MIN_HEIGHT_WIDTH)
+    else if (target.method == RESIZE_METHOD::MIN_HEIGHT_WIDTH)
     {
+        width = cols;
+        height = rows;
         // if the image is smaller than the minimum size, don't resize it
-        if (image.cols < opts.min_width && image.rows < opts.min_height)
+        if (cols < target.min_width && rows < target.min_height)
+            return RESIZE_STATUS::TOO_SMALL;
+        float ratio = (float)cols / (float)rows;
+        // stay over minimum size, but keep the ratio (only use target.min_width and target.min_height, they're not 0)
+        if (target.min_width / ratio > target.min_height)
         {
-            if (opts.dry_run)
-                return dry_run_print(path, image.cols, image.rows, true, "");
-            if (opts.verbose)
-                std::cerr << "Skipping " << path << " (too small)" << std::endl;
-            return;
-        }
-        float ratio = (float)image.cols / (float)image.rows;
-        // stay over minimum size, but keep the ratio (only use opts.min_width and opts.min_height, they're not 0)
-        if (opts.min_width / ratio > opts.min_height)
-        {
-            width = opts.min_width;
-            height = opts.min_width / ratio;
+            width = target.min_width;
+            height = target.min_width / ratio;
         }
         else
         {
-            width = opts.min_height * ratio;
-            height = opts.min_height;
+            width = target.min_height * ratio;
+            height = target.min_height;
         }
     } else {
         throw std::runtime_error("Invalid resize method, this should never happen");
     }
 
     // check if width and height are not equal to the original size
-    if (width == image.cols && height == image.rows)
-    {
-        if (opts.dry_run)
-            return dry_run_print(path, width, height, true, "");
-        if (opts.verbose)
-            std::cerr << "Skipping " << path << " (same size)" << std::endl;
-        return;
-    }
+    if (width == cols && height == rows)
+        return RESIZE_STATUS::SAME_SIZE;
+    return RESIZE_STATUS::RESIZE;
+}
 
-    // remove the extension
-    std::string output_path = path.substr(0, path.find_last_of("."));
+/**
+ * @brief Calculates the size an image should be resized to, using the
+ * command line resize method
+ */
+RESIZE_STATUS compute_target_size(resize_opts &opts, int cols, int rows, int &width, int &height)
+{
+    return compute_target_size(main_target(opts), cols, rows, width, height);
+}
 
+/**
+ * @brief Extracts the command line resize method and size from the options
+ *
+ * @param opts Reference to command line options
+ * @return target_spec Target of the resize
+ */
+target_spec main_target(resize_opts &opts)
+{
+    target_spec target;
+    target.method = opts.method;
+    target.scale = opts.scale;
+    target.width = opts.width;
+    target.height = opts.height;
+    target.min_width = opts.min_width;
+    target.min_height = opts.min_height;
+    return target;
+}
+
+/**
+ * @brief Builds the path the resized image is written to
+ *
+ * @param opts Reference to command line options
+ * @param path Path to the source image
+ * @return std::string Output path
+ */
+std::string make_output_path(resize_opts &opts, const std::string &path)
+{
     // if keep is set, append the suffix to the filename (before the extension)
-    if (opts.keep)
-    {
-        output_path += opts.suffix;
-    }
+    return make_output_path(opts, path, opts.keep ? opts.suffix : "");
+}
+
+/**
+ * @brief Builds the path the resized image is written to
+ *
+ * @param opts Reference to command line options
+ * @param path Path to the source image
+ * @param suffix Appended to the filename, before the extension
+ * @return std::string Output path
+ */
+std::string make_output_path(resize_opts &opts, const std::string &path, const std::string &suffix)
+{
+    // remove the extension
+    std::string output_path = path.substr(0, path.find_last_of(".")) + suffix;
 
     // replace the extension, if output_format is empty, no-op
     if (!opts.output_format.empty())
@@ -123,47 +288,284 @@ void process_image(resize_opts &opts, const std::string & path)
     {
         output_path += "." + path.substr(path.find_last_of(".") + 1);
     }
+    return output_path;
+}
 
-    bool upscale = false; // store whether the image is being upscaled or not
+/**
+ * @brief Checks whether a file name is one the run writes itself: a
+ * temporary file, or a name carrying the --keep or a rendition suffix
+ *
+ * @param opts Reference to command line options
+ * @param path Path of the file
+ */
+bool is_output_name(const resize_opts &opts, const std::string &path)
+{
+    size_t slash = path.find_last_of('/');
+    if (path.find(".tmp.", slash == std::string::npos ? 0 : slash + 1) != std::string::npos)
+        return true; // atomic writes in progress, a directory name may carry .tmp.
+    size_t dot = path.find_last_of('.');
+    std::string_view stem(path);
+    stem = stem.substr(0, (dot == std::string::npos || (slash != std::string::npos && dot < slash)) ? path.size() : dot);
 
+    auto ends_with = [&](const std::string &suffix) {
+        return !suffix.empty() && stem.size() >= suffix.size() && stem.substr(stem.size() - suffix.size()) == suffix;
+    };
+    if (opts.keep && ends_with(opts.suffix))
+        return true;
+    for (auto &rendition : opts.renditions)
+    {
+        if (ends_with(rendition.suffix))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Reports a skipped image (dry run or verbose mode)
+ *
+ * @param opts Reference to command line options
+ * @param path Path to the image
+ * @param status Why the image is skipped
+ * @param width Width of the image
+ * @param height Height of the image
+ */
+void report_skip(resize_opts &opts, const std::string &path, RESIZE_STATUS status, int width, int height)
+{
     if (opts.dry_run)
-        return dry_run_print(path, width, height, false, output_path);
+        return dry_run_print(path, width, height, true, "");
+    if (opts.verbose)
+        std::cerr << "Skipping " << path << ((status == RESIZE_STATUS::TOO_SMALL) ? " (too small)" : " (same size)") << std::endl;
+}
+
+/**
+ * @brief Probes the header of an image, when it is enough to skip the image
+ * or to describe the dry run, the image is never decoded
+ *
+ * @param opts Reference to command line options
+ * @param path Path to the image
+ * @param info Filled with the header of the image
+ * @param target Filled with the target size when it is known from the header
+ * @return true If the image is fully handled and must not be decoded
+ */
+bool skip_from_header(resize_opts &opts, const std::string &path, image_info &info, cv::Size &target)
+{
+    if (!probe_image(path, info))
+    {
+        info = image_info(); // unknown header, decode to find out
+        return false;
+    }
 
-    // resize the image
+    int width, height;
+    RESIZE_STATUS status = compute_target_size(opts, info.width, info.height, width, height);
+    if (status != RESIZE_STATUS::RESIZE)
+    {
+        report_skip(opts, path, status, info.width, info.height);
+        return true;
+    }
+    if (opts.dry_run)
+    {
+        dry_run_print(path, width, height, false, make_output_path(opts, path));
+        return true;
+    }
+    target = cv::Size(width, height);
+    return false;
+}
+
+/**
+ * @brief Resizes an image, src and dst may be the same image
+ *
+ * @param opts Reference to command line options
+ * @param path Path to the source image, used for error handling
+ * @param src Image to resize
+ * @param dst Filled with the resized image
+ * @param width Target width
+ * @param height Target height
+ * @return true If the image was resized
+ */
+bool resize_image(resize_opts &opts, const std::string &path, const cv::Mat &src, cv::Mat &dst, int width, int height)
+{
+    bool upscale = width > src.cols || height > src.rows;
+    int interpolation = (upscale) ? opts.up_interpolation : opts.down_interpolation;
+    stage_timer timer(STAGE::RESIZE);
+
+    // exact integer INTER_AREA downscales are plain box filters
+    if (!upscale && interpolation == cv::INTER_AREA && !opts.generic_resize && box_downscale_supported(src, width, height))
+    {
+        box_downscale(src, dst, width, height);
+        return true;
+    }
+    if (opts.coef_cache && separable_resize_supported(src, width, height, interpolation))
+    {
+        separable_resize(src, dst, width, height, interpolation);
+        return true;
+    }
     try {
         cv::resize(
-            image,
-            image,
+            src,
+            dst,
             cv::Size(width, height), 0, 0,
-            // use the correct interpolation
-            (upscale) ? opts.up_interpolation : opts.down_interpolation
+            interpolation
         );
     } catch (cv::Exception &e) {
         if (opts.verbose)
             std::cerr << "Failed to resize " << path << ": " << e.what() << std::endl;
         if (opts.delete_fails)
             std::remove(path.c_str());
-        return;
+        return false;
     }
+    return true;
+}
+
+/**
+ * @brief Encodes a resized image into a reused buffer and commits it with a
+ * single write and rename
+ *
+ * @param opts Reference to command line options
+ * @param path Path to the source image, used for error handling
+ * @param output_path Path to write the image to
+ * @param image Image to write
+ * @return true If the image was written
+ */
+bool write_image(resize_opts &opts, const std::string &path, const std::string &output_path, const cv::Mat &image)
+{
+    thread_local std::vector<uchar> buffer;
+    size_t capacity = buffer.capacity();
+    std::string error;
+    bool exception = false; // only codec errors delete the source, not I/O errors
 
-    // write the image
     try {
-        cv::imwrite(output_path, image, {cv::IMWRITE_JPEG_QUALITY, opts.jpeg_quality});
+        stage_timer timer(STAGE::ENCODE);
+        if (!cv::imencode(output_path.substr(output_path.find_last_of(".")), image, buffer, {cv::IMWRITE_JPEG_QUALITY, opts.jpeg_quality}))
+            error = "encoder failed";
     } catch (cv::Exception &e) {
+        error = e.what();
+        exception = true;
+    }
+
+    if (error.empty())
+    {
+        stage_timer timer(STAGE::WRITE);
+        if (!tar_output_active())
+            shard_claim_output(opts, output_path);
+        if (!(tar_output_active() ? tar_write(output_path, buffer) : write_file_atomic(output_path, buffer)))
+            error = std::strerror(errno);
+    }
+
+    if (!error.empty())
+    {
         if (opts.verbose)
-            std::cerr << "Failed to write " << output_path << ": " << e.what() << std::endl;
-        if (opts.delete_fails)
+            std::cerr << "Failed to write " << output_path << ": " << error << std::endl;
+        if (opts.delete_fails && exception)
             std::remove(path.c_str());
-        return;
+        return false;
+    }
+    pool_count_reuse(buffer.capacity() == capacity, buffer.size());
+    stats_add_bytes(0, buffer.size());
+    return true;
+}
+
+/**
+ * @brief Processes an image
+ * 
+ * @param opts Reference to command line options
+ * @param t Task of the image
+ * @return false If the image doesn't fit the memory budget yet and must be
+ * deferred, true once it was handled
+ */
+bool process_image(resize_opts &opts, task &t)
+{
+    const std::string &path = t.path;
+    if (manifest_unchanged(opts, path))
+    {
+        if (opts.verbose)
+            std::cerr << "Skipping " << path << " (unchanged since last run)" << std::endl;
+        return true;
+    }
+
+    image_info info;
+    cv::Size target;
+    if (skip_from_header(opts, path, info, target))
+    {
+        manifest_record(opts, path);
+        return true;
+    }
+    memory_reservation reservation;
+    if (!reservation.admit(t, estimate_image_memory(opts, info, target, {target})))
+        return false;
+
+    // huge images are decoded, resized and encoded a few rows at a time
+    if (stream_eligible(opts, info, target))
+    {
+        parallel_scope scope(opts, 0);
+        STREAM_STATUS status = stream_resize(opts, path, info, target.width, target.height, make_output_path(opts, path));
+        if (status == STREAM_STATUS::DONE)
+            manifest_record(opts, path);
+        if (status != STREAM_STATUS::UNSUPPORTED)
+            return true;
     }
+    parallel_scope scope(opts, decoded_pixels(opts, info, target));
+
+    cv::Mat image;
+    cv::Size source;
+    if (!decode_image(opts, path, info, target, image, source, true))
+        return true;
+
+    int width, height;
+    RESIZE_STATUS status = compute_target_size(opts, source.width, source.height, width, height);
+    if (status != RESIZE_STATUS::RESIZE)
+    {
+        report_skip(opts, path, status, source.width, source.height);
+        manifest_record(opts, path);
+        return true;
+    }
+
+    std::string output_path = make_output_path(opts, path);
+
+    if (opts.dry_run)
+    {
+        dry_run_print(path, width, height, false, output_path);
+        return true;
+    }
+
+    cv::Mat resized = pooled_mat(POOL_RESIZE, cv::Size(width, height), image.type());
+    if (!resize_image(opts, path, image, resized, width, height))
+        return true;
+
+    if (write_image(opts, path, output_path, resized))
+        manifest_record(opts, path);
+    return true;
 }
 
-void process_chunk(resize_opts &opts, std::vector<std::string> & files, size_t &total)
+/**
+ * @brief Worker loop, processes tasks from the scheduler until it is closed and drained
+ *
+ * @param opts Reference to command line options
+ * @param sched Scheduler to take tasks from
+ * @param worker Index of the worker
+ */
+void process_queue(resize_opts &opts, scheduler &sched, int worker)
 {
-    for (auto &file : files)
+    task t;
+    while (sched.pop(worker, t))
     {
-        process_image(opts, file);
-        if (opts.progress)
-            update_progress_bar(total);
+        if (t.job)
+            serve_run_job(opts, *t.job);
+        else if (!t.memory && !shard_claim(opts, t.path))
+        {
+            // processed by another shard, deferred tasks were claimed the first time
+            if (opts.verbose)
+                std::cerr << "Skipping " << t.path << " (claimed by another shard)" << std::endl;
+        }
+        else if (!(opts.renditions.empty() ? process_image(opts, t) : process_renditions(opts, t)))
+        {
+            if (opts.verbose)
+                std::cerr << "Deferring " << t.path << " until its " << t.memory / 1000000 << " MB fit in the memory budget" << std::endl;
+            sched.defer(std::move(t));
+            continue;
+        }
+        if (!opts.tar_input.empty())
+            memory_file_remove(t.path);
+        t.job.reset(); // a client connection closes with its last job
+        progress_image_done();
     }
 }
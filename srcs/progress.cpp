@@ -0,0 +1,104 @@
+#include "resize.hpp"
+#include <iomanip>
+#include <sstream>
+
+/*
+ * Workers only bump atomic counters, a dedicated thread draws the bar a few
+ * times per second so terminal I/O never serializes the workers.
+ */
+
+static std::atomic<size_t> done(0);
+static std::atomic<uint64_t> bytes(0);
+static std::atomic<bool> discovering(true);
+static std::atomic<size_t> *total = nullptr;
+static std::chrono::steady_clock::time_point start;
+
+static std::mutex mtx;
+static std::condition_variable wakeup;
+static bool stopping = false;
+static std::thread renderer;
+
+static std::string format_duration(double seconds)
+{
+    long s = static_cast<long>(seconds);
+    std::ostringstream ss;
+    ss << std::setfill('0') << std::setw(2) << s / 3600 << ":" << std::setw(2) << (s / 60) % 60 << ":" << std::setw(2) << s % 60;
+    return ss.str();
+}
+
+static void render()
+{
+    size_t current = done.load();
+    size_t count = total->load();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double rate = (elapsed > 0.0) ? current / elapsed : 0.0;
+    double throughput = (elapsed > 0.0) ? bytes.load() / 1e6 / elapsed : 0.0;
+
+    // print a fancy progress bar
+    std::ostringstream bar;
+    bar << "\r[";
+    for (size_t i = 0; i < 50; i++)
+        bar << ((count && i < (current * 50) / count) ? "=" : " ");
+    bar << "] " << (count ? (current * 100) / count : 0) << "% " << current << "/" << count << (discovering ? "+" : "")
+        << std::setprecision(1) << std::fixed << " | " << rate << " img/s | " << throughput << " MB/s";
+    if (!discovering && rate > 0.0)
+        bar << " | ETA " << format_duration((count - current) / rate);
+    bar << "   "; // clear leftovers of a longer previous line
+    std::cerr << bar.str() << std::flush;
+}
+
+static void render_loop(int interval_ms)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!wakeup.wait_for(lock, std::chrono::milliseconds(interval_ms), [] { return stopping; }))
+        render();
+}
+
+/**
+ * @brief Starts drawing the progress bar, if enabled
+ *
+ * @param opts Reference to command line options
+ * @param files Number of files found so far, grows while discovery runs
+ */
+void progress_start(resize_opts &opts, std::atomic<size_t> &files)
+{
+    total = &files;
+    start = std::chrono::steady_clock::now();
+    if (opts.progress)
+        renderer = std::thread(render_loop, 100);
+}
+
+/**
+ * @brief Marks the end of discovery, the total is final and an ETA can be shown
+ */
+void progress_discovery_done()
+{
+    discovering = false;
+}
+
+void progress_image_done()
+{
+    done.fetch_add(1, std::memory_order_relaxed);
+}
+
+void progress_add_bytes(uint64_t read)
+{
+    bytes.fetch_add(read, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Draws the final state of the progress bar and stops the render thread
+ */
+void progress_stop()
+{
+    if (!renderer.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    renderer.join();
+    render();
+    std::cerr << std::endl;
+}
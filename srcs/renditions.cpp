@@ -0,0 +1,154 @@
+#include "resize.hpp"
+
+struct rendition_job
+{
+    const rendition *spec;
+    RESIZE_STATUS status;
+    int width;
+    int height;
+    std::string output_path;
+    cv::Mat image;
+};
+
+/**
+ * @brief Computes the size of every rendition of an image, largest first
+ *
+ * @param opts Reference to command line options
+ * @param path Path to the source image
+ * @param cols Width of the source image
+ * @param rows Height of the source image
+ * @param jobs Filled with one job per rendition
+ * @return cv::Size Largest size to resize to, empty if no rendition needs a resize
+ */
+static cv::Size plan_renditions(resize_opts &opts, const std::string &path, int cols, int rows, std::vector<rendition_job> &jobs)
+{
+    cv::Size largest;
+
+    jobs.clear();
+    for (auto &spec : opts.renditions)
+    {
+        rendition_job job;
+        job.spec = &spec;
+        job.status = compute_target_size(spec.target, cols, rows, job.width, job.height);
+        job.output_path = make_output_path(opts, path, spec.suffix);
+        if (job.status == RESIZE_STATUS::RESIZE)
+        {
+            largest.width = std::max(largest.width, job.width);
+            largest.height = std::max(largest.height, job.height);
+        }
+        jobs.push_back(std::move(job));
+    }
+    std::stable_sort(jobs.begin(), jobs.end(), [](const rendition_job &a, const rendition_job &b) {
+        return static_cast<int64_t>(a.width) * a.height > static_cast<int64_t>(b.width) * b.height;
+    });
+    return largest;
+}
+
+/**
+ * @brief Reports the renditions that won't be written
+ *
+ * @return true If no rendition has to be resized
+ */
+static bool report_renditions(resize_opts &opts, const std::string &path, int cols, int rows, std::vector<rendition_job> &jobs)
+{
+    bool done = true;
+    for (auto &job : jobs)
+    {
+        if (job.status != RESIZE_STATUS::RESIZE)
+            report_skip(opts, path, job.status, cols, rows);
+        else if (opts.dry_run)
+            dry_run_print(path, job.width, job.height, false, job.output_path);
+        else
+            done = false;
+    }
+    return done;
+}
+
+/**
+ * @brief Processes an image into every rendition, the image is decoded once
+ * and each rendition is resized from the previous, larger one
+ *
+ * @param opts Reference to command line options
+ * @param t Task of the image
+ * @return false If the image doesn't fit the memory budget yet and must be
+ * deferred, true once it was handled
+ */
+bool process_renditions(resize_opts &opts, task &t)
+{
+    const std::string &path = t.path;
+    if (manifest_unchanged(opts, path))
+    {
+        if (opts.verbose)
+            std::cerr << "Skipping " << path << " (unchanged since last run)" << std::endl;
+        return true;
+    }
+
+    std::vector<rendition_job> jobs;
+    image_info info;
+    cv::Size target;
+    if (probe_image(path, info))
+    {
+        target = plan_renditions(opts, path, info.width, info.height, jobs);
+        if (report_renditions(opts, path, info.width, info.height, jobs))
+        {
+            manifest_record(opts, path);
+            return true;
+        }
+    }
+    else
+        info = image_info();
+
+    std::vector<cv::Size> outputs;
+    for (auto &job : jobs)
+    {
+        if (job.status == RESIZE_STATUS::RESIZE)
+            outputs.push_back(cv::Size(job.width, job.height));
+    }
+    memory_reservation reservation;
+    if (!reservation.admit(t, estimate_image_memory(opts, info, target, outputs)))
+        return false;
+    parallel_scope scope(opts, decoded_pixels(opts, info, target));
+
+    // decoded at the resolution the largest rendition needs
+    cv::Mat image;
+    cv::Size source;
+    if (!decode_image(opts, path, info, target, image, source, true))
+        return true;
+    if (info.format == IMAGE_FORMAT::UNKNOWN)
+    {
+        plan_renditions(opts, path, source.width, source.height, jobs);
+        if (report_renditions(opts, path, source.width, source.height, jobs))
+        {
+            manifest_record(opts, path);
+            return true;
+        }
+    }
+
+    // cascade, each rendition comes from the smallest larger one already done
+    const cv::Mat *previous = &image;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        rendition_job &job = jobs[i];
+        if (job.status != RESIZE_STATUS::RESIZE)
+            continue;
+        job.image = pooled_mat(POOL_RENDITION + i, cv::Size(job.width, job.height), image.type());
+        const cv::Mat *base = (previous->cols >= job.width && previous->rows >= job.height) ? previous : &image;
+        if (!resize_image(opts, path, *base, job.image, job.width, job.height))
+            return true;
+        previous = &job.image;
+    }
+    image.release();
+
+    // encode and write the renditions in parallel
+    std::atomic<bool> success(true);
+    cv::parallel_for_(cv::Range(0, jobs.size()), [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end; i++)
+        {
+            if (jobs[i].status == RESIZE_STATUS::RESIZE && !write_image(opts, path, jobs[i].output_path, jobs[i].image))
+                success = false;
+        }
+    });
+    if (success)
+        manifest_record(opts, path);
+    return true;
+}
@@ -0,0 +1,191 @@
+#include "resize.hpp"
+
+scheduler::scheduler(int workers)
+{
+    for (int i = 0; i < workers; i++)
+        queues.push_back(std::unique_ptr<worker_queue>(new worker_queue()));
+    counters.resize(workers);
+}
+
+/**
+ * @brief Queues a task, tasks are spread round-robin over the worker deques
+ *
+ * @param t Task to queue
+ */
+void scheduler::push(task t)
+{
+    worker_queue &queue = *queues[next++ % queues.size()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mtx);
+        queue.tasks.push_back(std::move(t));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        pending++;
+    }
+    cv.notify_one();
+}
+
+/**
+ * @brief Queues a task that didn't fit the memory budget, it is handed out
+ * again first once it fits, or once no other task is left
+ *
+ * @param t Task to queue, t.memory holds its estimated memory
+ */
+void scheduler::defer(task t)
+{
+    {
+        std::lock_guard<std::mutex> lock(deferred_mtx);
+        deferred.push_back(std::move(t));
+        deferred_size++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        pending++;
+    }
+    cv.notify_one();
+}
+
+/**
+ * @brief Takes the oldest deferred task
+ *
+ * @param t Filled with the task
+ * @param fitting Only take it if its memory fits right now
+ * @return true If a task was taken
+ */
+bool scheduler::try_pop_deferred(task &t, bool fitting)
+{
+    if (!deferred_size)
+        return false;
+    std::lock_guard<std::mutex> lock(deferred_mtx);
+    if (deferred.empty() || (fitting && !memory_budget_fits(deferred.front().memory)))
+        return false;
+    t = std::move(deferred.front());
+    deferred.pop_front();
+    deferred_size--;
+    return true;
+}
+
+/**
+ * @brief Blocks until fewer than limit tasks are waiting for a worker, lets a
+ * producer faster than the workers run with bounded memory
+ *
+ * @param limit Number of queued tasks to stay under
+ */
+void scheduler::wait_below(size_t limit)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    waiting++;
+    space.wait(lock, [this, limit] { return pending < limit || closed; });
+    waiting--;
+}
+
+/**
+ * @brief Signals that no more tasks will be pushed, workers return once
+ * every queue is drained
+ */
+void scheduler::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+    }
+    cv.notify_all();
+    space.notify_all();
+}
+
+bool scheduler::try_pop(int worker, task &t)
+{
+    // deferred tasks that fit now, before they're overtaken again
+    if (try_pop_deferred(t, true))
+        return true;
+
+    // own deque first, from the front
+    {
+        worker_queue &queue = *queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mtx);
+        if (!queue.tasks.empty())
+        {
+            t = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            return true;
+        }
+    }
+    // then steal from the back of the other deques
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+        worker_queue &victim = *queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mtx);
+        if (!victim.tasks.empty())
+        {
+            t = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            counters[worker].steals++;
+            return true;
+        }
+    }
+    // nothing else left, deferred tasks wait for memory on the worker
+    return try_pop_deferred(t, false);
+}
+
+/**
+ * @brief Takes the next task for a worker, blocks until one is available
+ *
+ * @param worker Index of the calling worker
+ * @param t Filled with the task
+ * @return true If a task was taken
+ * @return false If the scheduler is closed and every queue is empty
+ */
+bool scheduler::pop(int worker, task &t)
+{
+    worker_queue &queue = *queues[worker];
+    worker_stats &stats = counters[worker];
+    clock::time_point start = clock::now();
+
+    // time since the previous pop was spent processing that task
+    if (queue.running)
+        stats.busy += std::chrono::duration<double>(start - queue.last_pop).count();
+
+    bool found = false;
+    while (!found)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this] { return pending > 0 || closed; });
+            if (pending == 0)
+                break; // closed and drained
+            pending--;
+            if (waiting)
+                space.notify_all();
+        }
+        // a task is reserved for us, but another worker may be moving it
+        while (!(found = try_pop(worker, t)))
+            std::this_thread::yield();
+    }
+
+    queue.last_pop = clock::now();
+    queue.running = found;
+    stats.idle += std::chrono::duration<double>(queue.last_pop - start).count();
+    if (found)
+        stats.images++;
+    return found;
+}
+
+/**
+ * @brief Number of tasks queued and not yet taken by a worker
+ */
+size_t scheduler::queued()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return pending;
+}
+
+int scheduler::workers() const
+{
+    return queues.size();
+}
+
+const std::vector<worker_stats> &scheduler::stats() const
+{
+    return counters;
+}
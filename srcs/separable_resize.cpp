@@ -0,0 +1,357 @@
+#include "resize.hpp"
+#include <cfloat>
+#include <cmath>
+#include <unordered_map>
+
+/*
+ * Separable resampler for --coef_cache. Resizing is a horizontal then a
+ * vertical pass, each output sample being a weighted sum of a few source
+ * samples. The source indexes and weights of both passes only depend on
+ * the geometry and the interpolation, so they are computed once per
+ * (source size, target size, interpolation) and shared by every thread:
+ * batches dominated by a few camera resolutions skip the table setup
+ * cv::resize redoes for every image.
+ *
+ * Kernels follow OpenCV's definitions (half-pixel centers, replicated
+ * borders, A = -0.75 for cubic, 8 tap Lanczos, overlap weights for area),
+ * weights are floats for every depth so samples may differ by one from
+ * OpenCV's fixed point 8 bit paths.
+ */
+
+static const size_t max_entries = 256; // the cache starts over when full
+
+struct axis_table
+{
+    int taps = 0;
+    std::vector<int> index;    // taps per output sample, source sample or intermediate row
+    std::vector<float> weight; // taps per output sample, 0 for padding taps
+};
+
+struct resample_tables
+{
+    axis_table x;
+    axis_table y;           // indexes rows of the intermediate image
+    std::vector<int> rows;  // source rows read by the vertical pass, ascending
+};
+
+struct table_key
+{
+    int src_width;
+    int src_height;
+    int dst_width;
+    int dst_height;
+    int interpolation;
+    bool operator==(const table_key &other) const
+    {
+        return src_width == other.src_width && src_height == other.src_height && dst_width == other.dst_width &&
+               dst_height == other.dst_height && interpolation == other.interpolation;
+    }
+};
+
+struct table_key_hash
+{
+    size_t operator()(const table_key &key) const
+    {
+        uint64_t h = 1469598103934665603ULL;
+        for (int value : {key.src_width, key.src_height, key.dst_width, key.dst_height, key.interpolation})
+            h = (h ^ static_cast<uint32_t>(value)) * 1099511628211ULL;
+        return h;
+    }
+};
+
+static std::mutex cache_mtx;
+static std::unordered_map<table_key, std::shared_ptr<const resample_tables>, table_key_hash> cache;
+static std::atomic<uint64_t> hits(0);
+static std::atomic<uint64_t> misses(0);
+
+static void cubic_coefficients(float x, float *coeffs)
+{
+    const float A = -0.75f;
+
+    coeffs[0] = ((A * (x + 1) - 5 * A) * (x + 1) + 8 * A) * (x + 1) - 4 * A;
+    coeffs[1] = ((A + 2) * x - (A + 3)) * x * x + 1;
+    coeffs[2] = ((A + 2) * (1 - x) - (A + 3)) * (1 - x) * (1 - x) + 1;
+    coeffs[3] = 1.f - coeffs[0] - coeffs[1] - coeffs[2];
+}
+
+static void lanczos4_coefficients(float x, float *coeffs)
+{
+    static const double s45 = 0.70710678118654752440084436210485;
+    static const double cs[][2] = {{1, 0}, {-s45, -s45}, {0, 1}, {s45, -s45}, {-1, 0}, {s45, s45}, {0, -1}, {-s45, s45}};
+
+    if (x < FLT_EPSILON)
+    {
+        for (int i = 0; i < 8; i++)
+            coeffs[i] = 0;
+        coeffs[3] = 1;
+        return;
+    }
+    float sum = 0;
+    double y0 = -(x + 3) * CV_PI * 0.25, s0 = std::sin(y0), c0 = std::cos(y0);
+    for (int i = 0; i < 8; i++)
+    {
+        double y = -(x + 3 - i) * CV_PI * 0.25;
+        coeffs[i] = static_cast<float>((cs[i][0] * s0 + cs[i][1] * c0) / (y * y));
+        sum += coeffs[i];
+    }
+    for (int i = 0; i < 8; i++)
+        coeffs[i] /= sum;
+}
+
+/**
+ * @brief Computes the taps of one axis, indexes are clamped to the source
+ * (replicated border)
+ *
+ * @param src Source length
+ * @param dst Target length
+ * @param interpolation INTER_LINEAR, INTER_CUBIC, INTER_LANCZOS4, or
+ * INTER_AREA when dst <= src
+ */
+static axis_table build_axis(int src, int dst, int interpolation)
+{
+    double scale = static_cast<double>(src) / dst;
+    std::vector<std::vector<std::pair<int, float>>> samples(dst);
+
+    for (int d = 0; d < dst; d++)
+    {
+        auto &taps = samples[d];
+        if (interpolation == cv::INTER_AREA)
+        {
+            // overlap of [d * scale, (d + 1) * scale) with every source sample
+            double start = d * scale;
+            double end = start + scale;
+            double cell = std::min(scale, src - start);
+            int first = std::min(static_cast<int>(std::ceil(start)), src - 1);
+            int last = std::min(static_cast<int>(std::floor(end)), src - 1);
+            first = std::min(first, last);
+            if (first - start > 1e-3)
+                taps.push_back({first - 1, static_cast<float>((first - start) / cell)});
+            for (int s = first; s < last; s++)
+                taps.push_back({s, static_cast<float>(1.0 / cell)});
+            if (end - last > 1e-3)
+                taps.push_back({last, static_cast<float>(std::min(std::min(end - last, 1.0), cell) / cell)});
+            continue;
+        }
+
+        double center = (d + 0.5) * scale - 0.5;
+        int s = static_cast<int>(std::floor(center));
+        float fraction = static_cast<float>(center - s);
+        float coeffs[8];
+        int count, offset;
+        if (interpolation == cv::INTER_LINEAR)
+        {
+            coeffs[0] = 1.f - fraction;
+            coeffs[1] = fraction;
+            count = 2;
+            offset = 0;
+        }
+        else if (interpolation == cv::INTER_CUBIC)
+        {
+            cubic_coefficients(fraction, coeffs);
+            count = 4;
+            offset = -1;
+        }
+        else
+        {
+            lanczos4_coefficients(fraction, coeffs);
+            count = 8;
+            offset = -3;
+        }
+        for (int k = 0; k < count; k++)
+            taps.push_back({std::min(std::max(s + offset + k, 0), src - 1), coeffs[k]});
+    }
+
+    axis_table table;
+    for (auto &taps : samples)
+        table.taps = std::max(table.taps, static_cast<int>(taps.size()));
+    table.index.assign(static_cast<size_t>(dst) * table.taps, 0);
+    table.weight.assign(static_cast<size_t>(dst) * table.taps, 0.f);
+    for (int d = 0; d < dst; d++)
+    {
+        for (size_t k = 0; k < samples[d].size(); k++)
+        {
+            table.index[d * table.taps + k] = samples[d][k].first;
+            table.weight[d * table.taps + k] = samples[d][k].second;
+        }
+    }
+    return table;
+}
+
+static std::shared_ptr<const resample_tables> build_tables(const table_key &key)
+{
+    auto tables = std::make_shared<resample_tables>();
+    tables->x = build_axis(key.src_width, key.dst_width, key.interpolation);
+    tables->y = build_axis(key.src_height, key.dst_height, key.interpolation);
+
+    // only rows with a weight go through the horizontal pass, vertical taps point into them
+    std::vector<bool> used(key.src_height, false);
+    std::vector<int> slot(key.src_height, 0);
+    for (size_t i = 0; i < tables->y.index.size(); i++)
+    {
+        if (tables->y.weight[i] != 0.f)
+            used[tables->y.index[i]] = true;
+    }
+    for (int row = 0; row < key.src_height; row++)
+    {
+        if (used[row])
+        {
+            slot[row] = tables->rows.size();
+            tables->rows.push_back(row);
+        }
+    }
+    for (size_t i = 0; i < tables->y.index.size(); i++)
+        tables->y.index[i] = (tables->y.weight[i] != 0.f) ? slot[tables->y.index[i]] : 0;
+    return tables;
+}
+
+static std::shared_ptr<const resample_tables> find_tables(const table_key &key)
+{
+    {
+        std::lock_guard<std::mutex> lock(cache_mtx);
+        auto it = cache.find(key);
+        if (it != cache.end())
+        {
+            hits++;
+            return it->second;
+        }
+    }
+    // built unlocked, two threads missing the same key both build it
+    misses++;
+    auto tables = build_tables(key);
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    if (cache.size() >= max_entries)
+        cache.clear();
+    cache.emplace(key, tables);
+    return tables;
+}
+
+template <typename T>
+static void horizontal_pass(const cv::Mat &src, const resample_tables &tables, int cn, float *tmp, int width, const cv::Range &range)
+{
+    const int taps = tables.x.taps;
+    const size_t row_size = static_cast<size_t>(width) * cn;
+
+    for (int i = range.start; i < range.end; i++)
+    {
+        const T *in = src.ptr<T>(tables.rows[i]);
+        float *out = tmp + i * row_size;
+        for (int x = 0; x < width; x++)
+        {
+            const int *index = &tables.x.index[x * taps];
+            const float *weight = &tables.x.weight[x * taps];
+            for (int c = 0; c < cn; c++)
+            {
+                float sum = 0.f;
+                for (int k = 0; k < taps; k++)
+                    sum += weight[k] * in[index[k] * cn + c];
+                out[x * cn + c] = sum;
+            }
+        }
+    }
+}
+
+template <typename T>
+static void vertical_pass(const float *tmp, const resample_tables &tables, int cn, cv::Mat &dst, const cv::Range &range)
+{
+    const int taps = tables.y.taps;
+    const size_t row_size = static_cast<size_t>(dst.cols) * cn;
+    thread_local std::vector<float> acc;
+    acc.resize(row_size);
+
+    for (int y = range.start; y < range.end; y++)
+    {
+        const int *index = &tables.y.index[y * taps];
+        const float *weight = &tables.y.weight[y * taps];
+        std::fill(acc.begin(), acc.end(), 0.f);
+        for (int k = 0; k < taps; k++)
+        {
+            if (weight[k] == 0.f)
+                continue;
+            const float *row = tmp + index[k] * row_size;
+            const float w = weight[k];
+            for (size_t i = 0; i < row_size; i++)
+                acc[i] += w * row[i];
+        }
+        T *out = dst.ptr<T>(y);
+        for (size_t i = 0; i < row_size; i++)
+            out[i] = cv::saturate_cast<T>(acc[i]);
+    }
+}
+
+template <typename T>
+static void resample(const cv::Mat &src, cv::Mat &dst, const resample_tables &tables)
+{
+    thread_local std::vector<float> tmp;
+    int cn = src.channels();
+    tmp.resize(tables.rows.size() * dst.cols * cn);
+    float *intermediate = tmp.data(); // the passes may run on OpenCV's threads, which have their own tmp
+
+    // both passes split their rows over OpenCV's threads, a single one unless the image has every core
+    cv::parallel_for_(cv::Range(0, tables.rows.size()), [&](const cv::Range &range) {
+        horizontal_pass<T>(src, tables, cn, intermediate, dst.cols, range);
+    });
+    cv::parallel_for_(cv::Range(0, dst.rows), [&](const cv::Range &range) {
+        vertical_pass<T>(intermediate, tables, cn, dst, range);
+    });
+}
+
+/**
+ * @brief Checks if the separable resampler handles a resize, others go
+ * through cv::resize
+ *
+ * @param src Source image
+ * @param width Target width
+ * @param height Target height
+ * @param interpolation Interpolation of the resize
+ */
+bool separable_resize_supported(const cv::Mat &src, int width, int height, int interpolation)
+{
+    int depth = src.depth();
+    if (depth != CV_8U && depth != CV_16U && depth != CV_32F)
+        return false;
+    if (src.channels() > 4 || src.empty() || width <= 0 || height <= 0)
+        return false;
+    if (interpolation == cv::INTER_AREA)
+        return width <= src.cols && height <= src.rows; // OpenCV upscales "area" bilinearly
+    return interpolation == cv::INTER_LINEAR || interpolation == cv::INTER_CUBIC || interpolation == cv::INTER_LANCZOS4;
+}
+
+/**
+ * @brief Resizes with coefficient tables taken from the shared cache
+ *
+ * @param src Source image
+ * @param dst Resized image, reused when it already has the right size and
+ * type, may be src
+ * @param width Target width
+ * @param height Target height
+ * @param interpolation Interpolation of the resize
+ */
+void separable_resize(const cv::Mat &src, cv::Mat &dst, int width, int height, int interpolation)
+{
+    cv::Mat source = src; // dst may be src
+    std::shared_ptr<const resample_tables> tables = find_tables({source.cols, source.rows, width, height, interpolation});
+    dst.create(height, width, source.type());
+
+    switch (source.depth())
+    {
+    case CV_8U:
+        resample<uchar>(source, dst, *tables);
+        break;
+    case CV_16U:
+        resample<ushort>(source, dst, *tables);
+        break;
+    default:
+        resample<float>(source, dst, *tables);
+        break;
+    }
+}
+
+coef_cache_counters get_coef_cache_counters()
+{
+    coef_cache_counters counters;
+    counters.hits = hits;
+    counters.misses = misses;
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    counters.entries = cache.size();
+    return counters;
+}
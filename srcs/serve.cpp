@@ -0,0 +1,453 @@
+#include "resize.hpp"
+#include <csignal>
+#include <cstring>
+#include <iomanip>
+#include <list>
+#include <sstream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+/*
+ * Server mode: jobs are newline-delimited JSON objects read from stdin or
+ * from clients of a Unix socket,
+ *
+ *     {"id": "42", "path": "in.jpg", "target": "512x", "output": "out.jpg"}
+ *
+ * target uses the --renditions syntax and defaults to the command line
+ * target, output defaults to the usual output path. Jobs run on the warm
+ * worker pool and each one gets a JSON line back on its connection once it
+ * is done, in completion order.
+ */
+
+// checked by every loop waiting on a file descriptor
+static volatile std::sig_atomic_t stopping = 0;
+static const int poll_interval_ms = 200;
+// largest output side a job may ask for, the limit OpenCV decodes images up to
+static const int max_dimension = 1 << 20;
+// longest request line, a client that sends more without a newline is cut off
+static const size_t max_request_line = 1 << 16;
+
+struct serve_connection
+{
+    int in;
+    int out;
+    bool owned; // socket to close once the last job answered
+    std::mutex mtx;
+
+    serve_connection(int in, int out, bool owned) : in(in), out(out), owned(owned) {}
+    ~serve_connection()
+    {
+        if (owned)
+            ::close(in);
+    }
+};
+
+struct serve_job
+{
+    std::string id;
+    std::string path;
+    std::string output;
+    target_spec target;
+    std::chrono::steady_clock::time_point received;
+    std::shared_ptr<serve_connection> connection;
+};
+
+static void on_signal(int)
+{
+    stopping = 1;
+}
+
+/**
+ * @brief Escapes a string to be written between quotes in JSON
+ *
+ * @param str String to escape
+ * @return std::string Escaped string
+ */
+std::string json_escape(const std::string &str)
+{
+    std::string escaped;
+    escaped.reserve(str.size());
+    for (unsigned char c : str)
+    {
+        switch (c)
+        {
+        case '"': escaped += "\\\""; break;
+        case '\\': escaped += "\\\\"; break;
+        case '\n': escaped += "\\n"; break;
+        case '\r': escaped += "\\r"; break;
+        case '\t': escaped += "\\t"; break;
+        default:
+            if (c < 0x20)
+            {
+                char code[7];
+                std::snprintf(code, sizeof(code), "\\u%04x", c);
+                escaped += code;
+            }
+            else
+                escaped += c;
+        }
+    }
+    return escaped;
+}
+
+/**
+ * @brief Writes a response line, responses of concurrent jobs never interleave
+ *
+ * @param connection Connection to answer on
+ * @param id Id of the job
+ * @param fields Already formatted JSON members, after the id
+ */
+static void respond(serve_connection &connection, const std::string &id, const std::string &fields)
+{
+    std::string line = "{\"id\": \"" + json_escape(id) + "\", " + fields + "}\n";
+    std::lock_guard<std::mutex> lock(connection.mtx);
+    size_t written = 0;
+    while (written < line.size())
+    {
+        ssize_t ret = ::write(connection.out, line.data() + written, line.size() - written);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return; // client went away, nobody to tell
+        written += ret;
+    }
+}
+
+static void respond_error(serve_connection &connection, const std::string &id, const std::string &error)
+{
+    respond(connection, id, "\"status\": \"error\", \"error\": \"" + json_escape(error) + "\"");
+}
+
+/**
+ * @brief Checks a job target with the command line checks, and bounds its
+ * sizes so a request can't make a worker allocate without limit
+ *
+ * @param target Target of the job
+ * @return std::string Why the target is refused, empty if it is valid
+ */
+static std::string job_target_error(const target_spec &target)
+{
+    std::string error = target_error(target);
+    if (!error.empty())
+        return error;
+    if (std::max(std::max(target.width, target.height), std::max(target.min_width, target.min_height)) > max_dimension)
+        return "Target is larger than " + std::to_string(max_dimension) + " pixels";
+    return "";
+}
+
+/**
+ * @brief Computes the output size of a job
+ *
+ * @return false If the size is out of range, sizes derived from the source
+ * are checked in double precision before they are converted to int
+ */
+static bool job_target_size(const target_spec &target, int cols, int rows, int &width, int &height, RESIZE_STATUS &status)
+{
+    double ratio = static_cast<double>(cols) / rows;
+    double largest = 0;
+    if (target.method == RESIZE_METHOD::SCALE)
+        largest = std::max(cols, rows) * static_cast<double>(target.scale);
+    else if (target.method == RESIZE_METHOD::HEIGHT_WIDTH_DYN)
+        largest = std::max(target.height * ratio, target.width / ratio);
+    else if (target.method == RESIZE_METHOD::MIN_HEIGHT_WIDTH)
+        largest = std::max(target.min_height * ratio, target.min_width / ratio);
+    if (largest > max_dimension)
+        return false;
+    status = compute_target_size(target, cols, rows, width, height);
+    return status != RESIZE_STATUS::RESIZE || (width > 0 && height > 0 && width <= max_dimension && height <= max_dimension);
+}
+
+/**
+ * @brief Runs one job, answers errors and skips
+ *
+ * @param opts Reference to command line options
+ * @param job Job to run
+ */
+static void run_job(resize_opts &opts, serve_job &job)
+{
+    serve_connection &connection = *job.connection;
+    image_info info;
+    cv::Size target;
+    int width, height;
+    RESIZE_STATUS status;
+
+    if (probe_image(job.path, info))
+    {
+        if (!job_target_size(job.target, info.width, info.height, width, height, status))
+            return respond_error(connection, job.id, "target size out of range for " + job.path);
+        if (status != RESIZE_STATUS::RESIZE)
+        {
+            return respond(connection, job.id, std::string("\"status\": \"skipped\", \"reason\": \"")
+                + ((status == RESIZE_STATUS::TOO_SMALL) ? "too small" : "same size") + "\"");
+        }
+        target = cv::Size(width, height);
+    }
+    else
+        info = image_info();
+    parallel_scope scope(opts, decoded_pixels(opts, info, target));
+
+    cv::Mat image;
+    cv::Size source;
+    if (!decode_image(opts, job.path, info, target, image, source, true))
+        return respond_error(connection, job.id, "failed to decode " + job.path);
+
+    if (!job_target_size(job.target, source.width, source.height, width, height, status))
+        return respond_error(connection, job.id, "target size out of range for " + job.path);
+    if (status != RESIZE_STATUS::RESIZE)
+    {
+        return respond(connection, job.id, std::string("\"status\": \"skipped\", \"reason\": \"")
+            + ((status == RESIZE_STATUS::TOO_SMALL) ? "too small" : "same size") + "\"");
+    }
+
+    cv::Mat resized = pooled_mat(POOL_RESIZE, cv::Size(width, height), image.type());
+    if (!resize_image(opts, job.path, image, resized, width, height))
+        return respond_error(connection, job.id, "failed to resize " + job.path);
+    if (!write_image(opts, job.path, job.output, resized))
+        return respond_error(connection, job.id, "failed to write " + job.output);
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job.received).count();
+    std::ostringstream fields;
+    fields << "\"status\": \"ok\", \"output\": \"" << json_escape(job.output) << "\", \"width\": " << width
+           << ", \"height\": " << height << ", \"ms\": " << std::fixed << std::setprecision(3) << ms;
+    respond(connection, job.id, fields.str());
+}
+
+/**
+ * @brief Runs one job on a worker thread and answers it, a job that throws
+ * is answered with the error instead of taking the server down
+ *
+ * @param opts Reference to command line options
+ * @param job Job to run
+ */
+void serve_run_job(resize_opts &opts, serve_job &job)
+{
+    try {
+        run_job(opts, job);
+    } catch (std::exception &e) {
+        respond_error(*job.connection, job.id, "failed to process " + job.path + ": " + e.what());
+    }
+}
+
+/**
+ * @brief Parses one request line and queues its job, malformed requests are
+ * answered right away
+ *
+ * @param opts Reference to command line options
+ * @param sched Scheduler feeding the workers
+ * @param connection Connection the request came from
+ * @param line Request line
+ */
+static void queue_job(resize_opts &opts, scheduler &sched, const std::shared_ptr<serve_connection> &connection, const std::string &line)
+{
+    namespace pt = boost::property_tree;
+    std::shared_ptr<serve_job> job(new serve_job());
+    job->received = std::chrono::steady_clock::now();
+    job->connection = connection;
+
+    try {
+        pt::ptree request;
+        std::istringstream stream(line);
+        pt::read_json(stream, request);
+
+        job->id = request.get<std::string>("id", "");
+        job->path = request.get<std::string>("path", "");
+        if (job->path.empty())
+            return respond_error(*connection, job->id, "missing path");
+        job->target = request.count("target") ? parse_target_spec(request.get<std::string>("target")) : main_target(opts);
+        std::string error = job_target_error(job->target);
+        if (!error.empty())
+            return respond_error(*connection, job->id, request.count("target") ? "invalid target: " + error : "missing target");
+        job->output = request.get<std::string>("output", "");
+        if (job->output.empty())
+            job->output = make_output_path(opts, job->path);
+        if (boost::filesystem::path(job->output).extension().empty())
+            return respond_error(*connection, job->id, "output " + job->output + " has no extension to pick the format from");
+    } catch (pt::ptree_error &e) {
+        return respond_error(*connection, job->id, std::string("invalid request: ") + e.what());
+    } catch (std::runtime_error &e) {
+        return respond_error(*connection, job->id, e.what());
+    }
+
+    task t;
+    t.path = job->path;
+    t.job = job;
+    sched.push(std::move(t));
+}
+
+/**
+ * @brief Reads request lines from a connection until it is closed or the
+ * server stops, a line over max_request_line bytes gets an error and ends the
+ * connection, jobs already queued still answer
+ */
+static void read_requests(resize_opts &opts, scheduler &sched, std::shared_ptr<serve_connection> connection)
+{
+    std::string pending;
+    char buffer[1 << 16];
+
+    while (!stopping)
+    {
+        struct pollfd fd = {connection->in, POLLIN, 0};
+        int ready = ::poll(&fd, 1, poll_interval_ms);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready <= 0)
+            continue;
+
+        ssize_t size = ::read(connection->in, buffer, sizeof(buffer));
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            break;
+        pending.append(buffer, size);
+
+        size_t start = 0;
+        size_t newline;
+        while ((newline = pending.find('\n', start)) != std::string::npos && newline - start <= max_request_line)
+        {
+            std::string line = pending.substr(start, newline - start);
+            start = newline + 1;
+            if (line.find_first_not_of(" \t\r") != std::string::npos)
+                queue_job(opts, sched, connection, line);
+        }
+        pending.erase(0, start);
+        if (pending.size() > max_request_line)
+        {
+            respond_error(*connection, "", "request line longer than " + std::to_string(max_request_line) + " bytes");
+            pending.clear();
+            break;
+        }
+    }
+    if (!stopping && pending.find_first_not_of(" \t\r\n") != std::string::npos)
+        queue_job(opts, sched, connection, pending); // last line without a newline
+}
+
+/**
+ * @brief Opens the listening Unix socket, a stale socket file is replaced
+ *
+ * @param path Path of the socket
+ * @return int Listening socket, -1 on error
+ */
+static int listen_unix(const std::string &path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return -1;
+    }
+    if (::stat(path.c_str(), &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            std::cerr << path << " exists and is not a socket" << std::endl;
+            return -1;
+        }
+        ::unlink(path.c_str());
+    }
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to create socket: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (::bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 || ::listen(fd, SOMAXCONN) < 0)
+    {
+        std::cerr << "Failed to listen on " << path << ": " << std::strerror(errno) << std::endl;
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Accepts clients until SIGINT or SIGTERM, each client gets a reader
+ * thread and its jobs go to the shared workers
+ */
+static int serve_socket(resize_opts &opts, scheduler &sched)
+{
+    int listener = listen_unix(opts.serve);
+    if (listener < 0)
+        return (1);
+    if (opts.verbose)
+        std::cerr << "Listening on " << opts.serve << std::endl;
+
+    struct reader
+    {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+    std::list<reader> readers;
+
+    while (!stopping)
+    {
+        // reap readers of closed connections
+        for (auto it = readers.begin(); it != readers.end();)
+        {
+            if (*it->done)
+            {
+                it->thread.join();
+                it = readers.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        struct pollfd fd = {listener, POLLIN, 0};
+        if (::poll(&fd, 1, poll_interval_ms) <= 0)
+            continue;
+        int client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+            continue;
+
+        std::shared_ptr<serve_connection> connection(new serve_connection(client, client, true));
+        std::shared_ptr<std::atomic<bool>> done(new std::atomic<bool>(false));
+        readers.push_back({std::thread([&opts, &sched, connection, done]() {
+            read_requests(opts, sched, connection);
+            *done = true;
+        }), done});
+    }
+
+    ::close(listener);
+    ::unlink(opts.serve.c_str());
+    for (auto &r : readers)
+        r.thread.join();
+    return (0);
+}
+
+/**
+ * @brief Serves jobs from stdin (answered on stdout) or from a Unix socket,
+ * returns on end of input or on SIGINT / SIGTERM, the caller then drains the
+ * scheduler
+ *
+ * @param opts Reference to command line options
+ * @param sched Scheduler feeding the already started workers
+ * @return int Exit code
+ */
+int serve(resize_opts &opts, scheduler &sched)
+{
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    ::sigaction(SIGINT, &action, nullptr);
+    ::sigaction(SIGTERM, &action, nullptr);
+    std::signal(SIGPIPE, SIG_IGN); // clients may leave before their answers
+
+    if (opts.serve == "-")
+    {
+        read_requests(opts, sched, std::make_shared<serve_connection>(STDIN_FILENO, STDOUT_FILENO, false));
+        return (0);
+    }
+    return serve_socket(opts, sched);
+}
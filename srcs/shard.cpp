@@ -0,0 +1,125 @@
+#include "resize.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * --shard K/N splits one job across N independent processes: a path belongs
+ * to shard FNV-1a(path) % N, so every node given the same inputs agrees on
+ * the split without talking to the others. With --shard_claims, an image is
+ * claimed right before it is processed by creating a file named after it
+ * with O_CREAT | O_EXCL in a shared directory. A node done with its own
+ * shard then walks the inputs again and processes the other shards' images
+ * nobody claimed yet, so slow nodes are relieved without a coordinator and
+ * no image is processed twice. Outputs are claimed before they are written,
+ * so the second walk of another node doesn't take them for sources.
+ */
+
+static std::atomic<size_t> claims_won(0);
+static std::atomic<size_t> claims_lost(0);
+
+/**
+ * @brief Checks whether a path belongs to this process' shard
+ *
+ * @param opts Reference to command line options
+ * @param path Path as discovered, nodes must be given the same input paths
+ */
+bool shard_owns(const resize_opts &opts, std::string_view path)
+{
+    return opts.shard_count <= 1 || fnv1a(path.data(), path.size()) % opts.shard_count == static_cast<uint64_t>(opts.shard_index);
+}
+
+/**
+ * @brief Creates the claim file of a path, claims are named after two 64 bit
+ * hashes of the path and spread over 256 subdirectories
+ *
+ * @return int 0 if the claim was created, errno otherwise
+ */
+static int create_claim(const resize_opts &opts, const std::string &path)
+{
+    char name[40];
+    uint64_t first = fnv1a(path.data(), path.size());
+    uint64_t second = fnv1a(path.data(), path.size(), 0x9e3779b97f4a7c15ULL);
+    std::snprintf(name, sizeof(name), "%02x/%016llx%016llx", static_cast<unsigned>(first >> 56),
+                  static_cast<unsigned long long>(first), static_cast<unsigned long long>(second));
+    std::string claim = opts.shard_claims + "/" + name;
+
+    int fd = ::open(claim.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == ENOENT)
+    {
+        // subdirectories are created by whichever process needs them first
+        ::mkdir(claim.substr(0, opts.shard_claims.size() + 3).c_str(), 0755);
+        fd = ::open(claim.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    }
+    if (fd < 0)
+        return errno;
+    ::close(fd);
+    return 0;
+}
+
+/**
+ * @brief Claims an image before processing it, no-op without --shard_claims
+ *
+ * @param opts Reference to command line options
+ * @param path Path of the image
+ * @return false If another process already claimed the image. A claim that
+ * can't be created for another reason is reported, the image is processed
+ * anyway when it belongs to this shard so a broken claims directory can't
+ * drop images on every node
+ */
+bool shard_claim(const resize_opts &opts, const std::string &path)
+{
+    if (opts.shard_claims.empty())
+        return true;
+
+    int error = create_claim(opts, path);
+    if (error == EEXIST)
+    {
+        claims_lost++;
+        return false;
+    }
+    if (error)
+    {
+        // own images are processed anyway, other shards' are left to their owner
+        bool own = shard_owns(opts, path);
+        std::cerr << "Failed to claim " << path << ": " << std::strerror(error)
+                  << (own ? ", processing it unclaimed" : ", leaving it to its shard") << std::endl;
+        return own;
+    }
+    claims_won++;
+    return true;
+}
+
+/**
+ * @brief Claims an output before it is written, so no node steals it as a
+ * source, no-op without --shard_claims. An output already claimed, as the
+ * source it overwrites is, is written anyway
+ *
+ * @param opts Reference to command line options
+ * @param output_path Path the output is written to
+ */
+void shard_claim_output(const resize_opts &opts, const std::string &output_path)
+{
+    if (opts.shard_claims.empty())
+        return;
+    int error = create_claim(opts, output_path);
+    if (error && error != EEXIST)
+        std::cerr << "Failed to claim output " << output_path << ": " << std::strerror(error) << std::endl;
+}
+
+/**
+ * @brief Number of images claimed by this process
+ */
+size_t shard_claims_won()
+{
+    return claims_won;
+}
+
+/**
+ * @brief Number of images skipped because another process claimed them
+ */
+size_t shard_claims_lost()
+{
+    return claims_lost;
+}
@@ -0,0 +1,196 @@
+#include "resize.hpp"
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+/*
+ * Every thread owns its counters, registered once on first use, so timing a
+ * stage never takes a lock. They are merged when the report is printed, after
+ * the worker threads are joined.
+ */
+
+static const char *stage_names[] = {"discover", "probe", "decode", "resize", "encode", "write"};
+static const int stage_count = sizeof(stage_names) / sizeof(stage_names[0]);
+
+// 4 linear sub-buckets per power of two nanoseconds
+static const int sub_buckets = 4;
+static const int bucket_count = 64 * sub_buckets;
+
+struct stage_counters
+{
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t histogram[bucket_count] = {};
+};
+
+struct thread_stats
+{
+    stage_counters stages[stage_count];
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+};
+
+static bool enabled = false;
+static std::mutex mtx;
+static std::vector<std::unique_ptr<thread_stats>> registry;
+
+static thread_stats &local_stats()
+{
+    thread_local thread_stats *stats = nullptr;
+    if (!stats)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        registry.push_back(std::unique_ptr<thread_stats>(new thread_stats()));
+        stats = registry.back().get();
+    }
+    return *stats;
+}
+
+static int bucket_of(uint64_t ns)
+{
+    if (ns < sub_buckets)
+        return ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (msb - 2)) & (sub_buckets - 1);
+    return msb * sub_buckets + sub;
+}
+
+static double bucket_upper_ms(int bucket)
+{
+    if (bucket < sub_buckets)
+        return (bucket + 1) / 1e6;
+    int msb = bucket / sub_buckets;
+    int sub = bucket % sub_buckets;
+    return ((1ULL << msb) + (static_cast<uint64_t>(sub + 1) << (msb - 2))) / 1e6;
+}
+
+void stats_enable()
+{
+    enabled = true;
+}
+
+bool stats_enabled()
+{
+    return enabled;
+}
+
+void stats_add_bytes(uint64_t read, uint64_t written)
+{
+    if (!enabled)
+        return;
+    thread_stats &stats = local_stats();
+    stats.bytes_read += read;
+    stats.bytes_written += written;
+}
+
+stage_timer::stage_timer(STAGE stage) : stage(stage), active(enabled)
+{
+    if (active)
+        start = std::chrono::steady_clock::now();
+}
+
+stage_timer::~stage_timer()
+{
+    if (!active)
+        return;
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    stage_counters &counters = local_stats().stages[static_cast<int>(stage)];
+    counters.count++;
+    counters.total_ns += ns;
+    counters.max_ns = std::max(counters.max_ns, ns);
+    counters.histogram[bucket_of(ns)]++;
+}
+
+static double percentile_ms(const stage_counters &counters, double p)
+{
+    uint64_t rank = static_cast<uint64_t>(counters.count * p);
+    uint64_t seen = 0;
+    for (int i = 0; i < bucket_count; i++)
+    {
+        seen += counters.histogram[i];
+        if (seen > rank)
+            return std::min(bucket_upper_ms(i), counters.max_ns / 1e6);
+    }
+    return counters.max_ns / 1e6;
+}
+
+/**
+ * @brief Prints the per-stage timings and writes them as JSON
+ *
+ * @param opts Reference to command line options
+ * @param elapsed Wall time of the run in seconds
+ */
+void print_stats(resize_opts &opts, double elapsed)
+{
+    thread_stats merged;
+    for (auto &stats : registry)
+    {
+        for (int s = 0; s < stage_count; s++)
+        {
+            stage_counters &into = merged.stages[s];
+            const stage_counters &from = stats->stages[s];
+            into.count += from.count;
+            into.total_ns += from.total_ns;
+            into.max_ns = std::max(into.max_ns, from.max_ns);
+            for (int i = 0; i < bucket_count; i++)
+                into.histogram[i] += from.histogram[i];
+        }
+        merged.bytes_read += stats->bytes_read;
+        merged.bytes_written += stats->bytes_written;
+    }
+
+    std::ostringstream report;
+    report << "Stage timings (" << std::setprecision(3) << std::fixed << elapsed << "s, "
+           << merged.bytes_read / 1e6 << " MB read, " << merged.bytes_written / 1e6 << " MB written):" << std::endl;
+    report << "\tStage     Count     Total (s) Mean (ms) p50 (ms)  p99 (ms)  Max (ms)" << std::endl;
+    for (int s = 0; s < stage_count; s++)
+    {
+        const stage_counters &counters = merged.stages[s];
+        report << "\t" << std::left << std::setw(10) << stage_names[s] << std::setw(10) << counters.count
+               << std::setw(10) << counters.total_ns / 1e9
+               << std::setw(10) << (counters.count ? counters.total_ns / 1e6 / counters.count : 0.0)
+               << std::setw(10) << percentile_ms(counters, 0.50)
+               << std::setw(10) << percentile_ms(counters, 0.99)
+               << counters.max_ns / 1e6 << std::right << std::endl;
+    }
+    pool_counters pools = get_pool_counters();
+    report << "Buffer pools: " << pools.reused << " allocations avoided (" << pools.reused_bytes / 1e6 << " MB), "
+           << pools.grown << " grown, " << pools.mispredicted << " mispredicted decodes" << std::endl;
+    coef_cache_counters coefs = get_coef_cache_counters();
+    if (opts.coef_cache)
+    {
+        report << "Coefficient cache: " << coefs.hits << " hits, " << coefs.misses << " misses ("
+               << 100.0 * coefs.hits / std::max<uint64_t>(coefs.hits + coefs.misses, 1) << "% hit rate), "
+               << coefs.entries << " geometries" << std::endl;
+    }
+    std::cerr << report.str();
+
+    if (opts.stats.empty() || opts.stats == "-")
+        return;
+    std::ofstream json(opts.stats);
+    if (!json)
+    {
+        std::cerr << "Failed to write stats to " << opts.stats << std::endl;
+        return;
+    }
+    json << std::setprecision(3) << std::fixed;
+    json << "{\n  \"wall_seconds\": " << elapsed << ",\n  \"threads\": " << opts.threads
+         << ",\n  \"bytes_read\": " << merged.bytes_read << ",\n  \"bytes_written\": " << merged.bytes_written
+         << ",\n  \"pools\": {\"reused\": " << pools.reused << ", \"reused_bytes\": " << pools.reused_bytes
+         << ", \"grown\": " << pools.grown << ", \"mispredicted\": " << pools.mispredicted << "}"
+         << ",\n  \"coef_cache\": {\"enabled\": " << (opts.coef_cache ? "true" : "false") << ", \"hits\": " << coefs.hits
+         << ", \"misses\": " << coefs.misses << ", \"entries\": " << coefs.entries << "}"
+         << ",\n  \"stages\": {";
+    for (int s = 0; s < stage_count; s++)
+    {
+        const stage_counters &counters = merged.stages[s];
+        json << (s ? "," : "") << "\n    \"" << stage_names[s] << "\": {\"count\": " << counters.count
+             << ", \"total_ms\": " << counters.total_ns / 1e6
+             << ", \"mean_ms\": " << (counters.count ? counters.total_ns / 1e6 / counters.count : 0.0)
+             << ", \"p50_ms\": " << percentile_ms(counters, 0.50)
+             << ", \"p99_ms\": " << percentile_ms(counters, 0.99)
+             << ", \"max_ms\": " << counters.max_ns / 1e6 << "}";
+    }
+    json << "\n  }\n}" << std::endl;
+}
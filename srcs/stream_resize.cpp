@@ -0,0 +1,546 @@
+#include "resize.hpp"
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <png.h>
+#include <jpeglib.h>
+
+/*
+ * Streaming downscale for images too large to decode whole: rows are
+ * decoded one at a time with libpng or libjpeg, filtered, and encoded as
+ * soon as an output row is complete. Only a few rows of the source and of
+ * the output are ever in memory.
+ *
+ * The filter is INTER_AREA's: each output pixel is the mean of the source
+ * area it covers, partially covered pixels weighted by their coverage.
+ * Coverage is counted in integers, a source pixel being dst_w x dst_h
+ * units and an output pixel src_w x src_h, so sums are exact and the
+ * result is rounded once.
+ *
+ * libpng and libjpeg report errors with longjmp, the functions calling
+ * them only hold trivially destructible locals.
+ */
+
+static void png_error_silent(png_structp png, png_const_charp)
+{
+    png_longjmp(png, 1);
+}
+
+static void png_warning_silent(png_structp, png_const_charp) {}
+
+struct png_source
+{
+    const uchar *data;
+    size_t size;
+    size_t offset;
+};
+
+static void png_read_source(png_structp png, png_bytep out, png_size_t length)
+{
+    png_source *source = static_cast<png_source *>(png_get_io_ptr(png));
+    if (length > source->size - source->offset)
+        png_error(png, "truncated file");
+    std::memcpy(out, source->data + source->offset, length);
+    source->offset += length;
+}
+
+struct jpeg_error
+{
+    struct jpeg_error_mgr mgr; // first, libjpeg only knows about this part
+    jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr info)
+{
+    std::longjmp(reinterpret_cast<jpeg_error *>(info->err)->jump, 1);
+}
+
+static void jpeg_message_silent(j_common_ptr, int) {}
+
+enum class DECODER_STATUS
+{
+    READY,
+    UNSUPPORTED, // valid image the decoder can't stream, e.g. an interlaced PNG
+    FAILED
+};
+
+/**
+ * @brief Row by row PNG or JPEG decoder, rows come out as gray, gray + alpha,
+ * RGB or RGBA with 8 or 16 bit native endian samples
+ */
+class stream_decoder
+{
+public:
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int depth = 0; // bits per sample
+
+    ~stream_decoder()
+    {
+        if (png)
+            png_destroy_read_struct(&png, &png_info, nullptr);
+        if (jpeg_created)
+            jpeg_destroy_decompress(&jpeg);
+    }
+
+    DECODER_STATUS open(const uchar *data, size_t size, IMAGE_FORMAT format, int scale)
+    {
+        return (format == IMAGE_FORMAT::PNG) ? open_png(data, size) : open_jpeg(data, size, scale);
+    }
+
+    bool read_row(uchar *row)
+    {
+        if (png)
+        {
+            if (setjmp(png_jmpbuf(png)))
+                return false;
+            png_read_row(png, row, nullptr);
+            return true;
+        }
+        if (setjmp(jpeg_err.jump))
+            return false;
+        JSAMPROW rows[1] = {row};
+        return jpeg_read_scanlines(&jpeg, rows, 1) == 1;
+    }
+
+private:
+    png_structp png = nullptr;
+    png_infop png_info = nullptr;
+    png_source source = {nullptr, 0, 0};
+    struct jpeg_decompress_struct jpeg;
+    jpeg_error jpeg_err;
+    bool jpeg_created = false;
+
+    DECODER_STATUS open_png(const uchar *data, size_t size)
+    {
+        source = {data, size, 0};
+        png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_silent, png_warning_silent);
+        if (!png)
+            return DECODER_STATUS::FAILED;
+        png_info = png_create_info_struct(png);
+        if (!png_info)
+            return DECODER_STATUS::FAILED;
+        if (setjmp(png_jmpbuf(png)))
+            return DECODER_STATUS::FAILED;
+
+        png_set_read_fn(png, &source, png_read_source);
+        png_read_info(png, png_info);
+        if (png_get_interlace_type(png, png_info) != PNG_INTERLACE_NONE)
+            return DECODER_STATUS::UNSUPPORTED; // rows only exist after the last pass
+
+        int color_type = png_get_color_type(png, png_info);
+        int bit_depth = png_get_bit_depth(png, png_info);
+        if (color_type == PNG_COLOR_TYPE_PALETTE)
+            png_set_palette_to_rgb(png);
+        if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+            png_set_expand_gray_1_2_4_to_8(png);
+        bool transparent = png_get_valid(png, png_info, PNG_INFO_tRNS);
+        if (transparent)
+            png_set_tRNS_to_alpha(png);
+        // gray and alpha decodes to BGRA through OpenCV, and no encoder takes 2 channels
+        if (color_type == PNG_COLOR_TYPE_GRAY_ALPHA || (color_type == PNG_COLOR_TYPE_GRAY && transparent))
+            png_set_gray_to_rgb(png);
+        if (bit_depth == 16)
+            png_set_swap(png); // PNG samples are big endian
+        png_read_update_info(png, png_info);
+
+        width = png_get_image_width(png, png_info);
+        height = png_get_image_height(png, png_info);
+        channels = png_get_channels(png, png_info);
+        depth = png_get_bit_depth(png, png_info);
+        return DECODER_STATUS::READY;
+    }
+
+    DECODER_STATUS open_jpeg(const uchar *data, size_t size, int scale)
+    {
+        jpeg.err = jpeg_std_error(&jpeg_err.mgr);
+        jpeg_err.mgr.error_exit = jpeg_error_exit;
+        jpeg_err.mgr.emit_message = jpeg_message_silent;
+        if (setjmp(jpeg_err.jump))
+            return DECODER_STATUS::FAILED;
+
+        jpeg_create_decompress(&jpeg);
+        jpeg_created = true;
+        jpeg_mem_src(&jpeg, const_cast<uchar *>(data), size);
+        jpeg_read_header(&jpeg, TRUE);
+        if (jpeg.num_components != 1 && jpeg.num_components != 3)
+            return DECODER_STATUS::UNSUPPORTED; // CMYK
+        jpeg.out_color_space = (jpeg.num_components == 1) ? JCS_GRAYSCALE : JCS_RGB;
+        jpeg.scale_num = 1;
+        jpeg.scale_denom = scale;
+        jpeg_start_decompress(&jpeg);
+
+        width = jpeg.output_width;
+        height = jpeg.output_height;
+        channels = jpeg.output_components;
+        depth = 8;
+        return DECODER_STATUS::READY;
+    }
+};
+
+/**
+ * @brief Row by row PNG or JPEG encoder writing to a stdio stream, takes the
+ * rows stream_decoder produces
+ */
+class stream_encoder
+{
+public:
+    ~stream_encoder()
+    {
+        if (png)
+            png_destroy_write_struct(&png, &png_info);
+        if (jpeg_created)
+            jpeg_destroy_compress(&jpeg);
+    }
+
+    bool open(FILE *file, IMAGE_FORMAT format, int width, int height, int channels, int depth, int quality)
+    {
+        return (format == IMAGE_FORMAT::PNG) ? open_png(file, width, height, channels, depth) : open_jpeg(file, width, height, channels, quality);
+    }
+
+    bool write_row(const uchar *row)
+    {
+        if (png)
+        {
+            if (setjmp(png_jmpbuf(png)))
+                return false;
+            png_write_row(png, row);
+            return true;
+        }
+        if (setjmp(jpeg_err.jump))
+            return false;
+        JSAMPROW rows[1] = {const_cast<uchar *>(row)};
+        return jpeg_write_scanlines(&jpeg, rows, 1) == 1;
+    }
+
+    bool finish()
+    {
+        if (png)
+        {
+            if (setjmp(png_jmpbuf(png)))
+                return false;
+            png_write_end(png, nullptr);
+            return true;
+        }
+        if (setjmp(jpeg_err.jump))
+            return false;
+        jpeg_finish_compress(&jpeg);
+        return true;
+    }
+
+private:
+    png_structp png = nullptr;
+    png_infop png_info = nullptr;
+    struct jpeg_compress_struct jpeg;
+    jpeg_error jpeg_err;
+    bool jpeg_created = false;
+
+    bool open_png(FILE *file, int width, int height, int channels, int depth)
+    {
+        static const int color_types[] = {PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA};
+
+        png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_silent, png_warning_silent);
+        if (!png)
+            return false;
+        png_info = png_create_info_struct(png);
+        if (!png_info)
+            return false;
+        if (setjmp(png_jmpbuf(png)))
+            return false;
+
+        png_init_io(png, file);
+        png_set_compression_level(png, 1); // OpenCV's default
+        png_set_IHDR(png, png_info, width, height, depth, color_types[channels - 1],
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png, png_info);
+        if (depth == 16)
+            png_set_swap(png);
+        return true;
+    }
+
+    bool open_jpeg(FILE *file, int width, int height, int channels, int quality)
+    {
+        jpeg.err = jpeg_std_error(&jpeg_err.mgr);
+        jpeg_err.mgr.error_exit = jpeg_error_exit;
+        jpeg_err.mgr.emit_message = jpeg_message_silent;
+        if (setjmp(jpeg_err.jump))
+            return false;
+
+        jpeg_create_compress(&jpeg);
+        jpeg_created = true;
+        jpeg_stdio_dest(&jpeg, file);
+        jpeg.image_width = width;
+        jpeg.image_height = height;
+        jpeg.input_components = channels;
+        jpeg.in_color_space = (channels == 1) ? JCS_GRAYSCALE : JCS_RGB;
+        jpeg_set_defaults(&jpeg);
+        jpeg_set_quality(&jpeg, quality, TRUE);
+        jpeg_start_compress(&jpeg, TRUE);
+        return true;
+    }
+};
+
+/**
+ * @brief Streaming area filter, takes source rows in order and hands out
+ * each output row once every source row it covers was pushed
+ */
+class area_stream
+{
+public:
+    area_stream(int src_w, int src_h, int dst_w, int dst_h, int channels, bool wide)
+        : src_w(src_w), src_h(src_h), dst_w(dst_w), dst_h(dst_h), channels(channels), wide(wide),
+          total(static_cast<uint64_t>(src_w) * src_h), line(dst_w * channels), current(dst_w * channels), next(dst_w * channels)
+    {
+        // source columns covered by each output column, with their coverage
+        for (int x = 0; x < dst_w; x++)
+        {
+            int64_t start = static_cast<int64_t>(x) * src_w;
+            int64_t end = start + src_w;
+            first.push_back(start / dst_w);
+            offsets.push_back(weights.size());
+            for (int64_t i = start / dst_w; i * dst_w < end; i++)
+                weights.push_back(std::min(end, (i + 1) * dst_w) - std::max(start, i * dst_w));
+        }
+        offsets.push_back(weights.size());
+    }
+
+    /**
+     * @brief Adds the next source row
+     *
+     * @param row Source row
+     * @param out Filled with an output row when one is complete
+     * @return true If out holds a new output row
+     */
+    bool push(const uchar *row, uchar *out)
+    {
+        if (wide)
+            filter_line(reinterpret_cast<const uint16_t *>(row));
+        else
+            filter_line(row);
+
+        // coverage of this source row over the current output row, the rest spills into the next one
+        uint64_t row_end = static_cast<uint64_t>(src_row + 1) * dst_h;
+        uint64_t out_end = static_cast<uint64_t>(out_row + 1) * src_h;
+        uint64_t inside = std::min<uint64_t>(row_end, out_end) - static_cast<uint64_t>(src_row) * dst_h;
+        uint64_t spill = dst_h - inside;
+        for (size_t i = 0; i < line.size(); i++)
+        {
+            current[i] += line[i] * inside;
+            next[i] += line[i] * spill;
+        }
+        src_row++;
+        if (row_end < out_end)
+            return false;
+
+        if (wide)
+            store(reinterpret_cast<uint16_t *>(out));
+        else
+            store(out);
+        current.swap(next);
+        std::fill(next.begin(), next.end(), 0);
+        out_row++;
+        return true;
+    }
+
+private:
+    int src_w, src_h, dst_w, dst_h, channels;
+    bool wide;
+    uint64_t total; // units in an output pixel
+    std::vector<int64_t> first;
+    std::vector<size_t> offsets;
+    std::vector<uint32_t> weights;
+    std::vector<uint64_t> line, current, next;
+    int src_row = 0;
+    int out_row = 0;
+
+    template <typename T>
+    void filter_line(const T *row)
+    {
+        for (int x = 0; x < dst_w; x++)
+        {
+            const T *in = row + first[x] * channels;
+            for (int c = 0; c < channels; c++)
+            {
+                uint64_t sum = 0;
+                for (size_t k = offsets[x], i = 0; k < offsets[x + 1]; k++, i++)
+                    sum += static_cast<uint64_t>(in[i * channels + c]) * weights[k];
+                line[x * channels + c] = sum;
+            }
+        }
+    }
+
+    template <typename T>
+    void store(T *out)
+    {
+        for (size_t i = 0; i < current.size(); i++)
+            out[i] = static_cast<T>((current[i] + total / 2) / total);
+    }
+};
+
+/**
+ * @brief Checks whether an image is decoded and resized in row bands rather
+ * than whole
+ *
+ * @param opts Reference to command line options
+ * @param info Header of the image
+ * @param target Target size
+ * @return true For PNG and JPEG images of at least stream_threshold pixels
+ * downscaled with INTER_AREA
+ */
+bool stream_eligible(const resize_opts &opts, const image_info &info, const cv::Size &target)
+{
+    if (!opts.stream_threshold || (info.format != IMAGE_FORMAT::PNG && info.format != IMAGE_FORMAT::JPEG))
+        return false;
+    if (static_cast<uint64_t>(info.width) * info.height < opts.stream_threshold)
+        return false;
+    return opts.down_interpolation == cv::INTER_AREA && target.width <= info.width && target.height <= info.height;
+}
+
+/**
+ * @brief Swaps the first and third channel of each pixel of a row
+ */
+static void swap_red_blue(uchar *row, int width, int channels, size_t sample)
+{
+    size_t pixel = channels * sample;
+    for (int x = 0; x < width; x++)
+        std::swap_ranges(row + x * pixel, row + x * pixel + sample, row + x * pixel + 2 * sample);
+}
+
+/**
+ * @brief Picks the streaming encoder for an output path
+ *
+ * @return IMAGE_FORMAT::UNKNOWN if the output has to be encoded whole
+ */
+static IMAGE_FORMAT stream_output_format(const std::string &output_path, int channels, int depth)
+{
+    std::string ext = boost::filesystem::extension(output_path);
+    boost::algorithm::to_lower(ext);
+    if (ext == ".png")
+        return IMAGE_FORMAT::PNG;
+    if ((ext == ".jpg" || ext == ".jpeg") && depth == 8 && (channels == 1 || channels == 3))
+        return IMAGE_FORMAT::JPEG;
+    return IMAGE_FORMAT::UNKNOWN;
+}
+
+/**
+ * @brief Downscales an image in row bands, peak memory grows with the width
+ * of the image but not its height. Outputs other than PNG and JPEG, and
+ * outputs going to a --tar_output archive, are assembled whole and written
+ * by write_image.
+ *
+ * @param opts Reference to command line options
+ * @param path Path to the image
+ * @param info Header of the image
+ * @param width Target width
+ * @param height Target height
+ * @param output_path Path to write the image to
+ * @return STREAM_STATUS::UNSUPPORTED if the image has to go through the regular path
+ */
+STREAM_STATUS stream_resize(resize_opts &opts, const std::string &path, const image_info &info, int width, int height, const std::string &output_path)
+{
+    mapped_file file;
+    stream_decoder decoder;
+    DECODER_STATUS status = DECODER_STATUS::FAILED;
+
+    if (file.open(path))
+    {
+        stage_timer timer(STAGE::DECODE);
+        status = decoder.open(file.data(), file.size(), info.format, reduced_decode_scale(reduced_decode_flag(opts, info, cv::Size(width, height))));
+    }
+    if (status == DECODER_STATUS::UNSUPPORTED)
+        return STREAM_STATUS::UNSUPPORTED;
+    if (status == DECODER_STATUS::FAILED || decoder.width < width || decoder.height < height)
+    {
+        if (opts.verbose)
+            std::cerr << "Failed to open " << path << std::endl;
+        if (opts.delete_fails)
+            std::remove(path.c_str());
+        return STREAM_STATUS::FAILED;
+    }
+    progress_add_bytes(file.size());
+    stats_add_bytes(file.size(), 0);
+
+    int channels = decoder.channels;
+    int depth = decoder.depth;
+    size_t sample = depth / 8;
+    // archive entries need their size up front, outputs are small enough to be encoded whole
+    IMAGE_FORMAT format = tar_output_active() ? IMAGE_FORMAT::UNKNOWN : stream_output_format(output_path, channels, depth);
+    area_stream filter(decoder.width, decoder.height, width, height, channels, depth == 16);
+    std::vector<uchar> src_row(decoder.width * channels * sample);
+    std::vector<uchar> dst_row(width * channels * sample);
+
+    atomic_file output;
+    stream_encoder encoder;
+    cv::Mat whole; // outputs without a streaming encoder
+    if (format != IMAGE_FORMAT::UNKNOWN)
+        shard_claim_output(opts, output_path);
+    if (format == IMAGE_FORMAT::UNKNOWN)
+        whole.create(height, width, CV_MAKETYPE((depth == 16) ? CV_16U : CV_8U, channels));
+    else if (!output.open(output_path) || !encoder.open(output.stream(), format, width, height, channels, depth, opts.jpeg_quality))
+    {
+        if (opts.verbose)
+            std::cerr << "Failed to write " << output_path << std::endl;
+        return STREAM_STATUS::FAILED;
+    }
+
+    for (int y = 0, out_y = 0; y < decoder.height; y++)
+    {
+        bool done;
+        {
+            stage_timer timer(STAGE::DECODE);
+            if (!decoder.read_row(src_row.data()))
+            {
+                if (opts.verbose)
+                    std::cerr << "Failed to decode " << path << " at row " << y << std::endl;
+                if (opts.delete_fails)
+                    std::remove(path.c_str());
+                return STREAM_STATUS::FAILED;
+            }
+        }
+        {
+            stage_timer timer(STAGE::RESIZE);
+            done = filter.push(src_row.data(), dst_row.data());
+        }
+        if (!done)
+            continue;
+
+        if (format == IMAGE_FORMAT::UNKNOWN)
+        {
+            // decoders give RGB, OpenCV expects BGR
+            if (channels >= 3)
+                swap_red_blue(dst_row.data(), width, channels, sample);
+            std::memcpy(whole.ptr(out_y), dst_row.data(), dst_row.size());
+        }
+        else
+        {
+            stage_timer timer(STAGE::ENCODE);
+            if (!encoder.write_row(dst_row.data()))
+            {
+                if (opts.verbose)
+                    std::cerr << "Failed to write " << output_path << std::endl;
+                return STREAM_STATUS::FAILED;
+            }
+        }
+        out_y++;
+    }
+
+    if (format == IMAGE_FORMAT::UNKNOWN)
+        return write_image(opts, path, output_path, whole) ? STREAM_STATUS::DONE : STREAM_STATUS::FAILED;
+
+    bool committed;
+    {
+        stage_timer timer(STAGE::WRITE);
+        long size = encoder.finish() ? std::ftell(output.stream()) : -1;
+        committed = size >= 0 && output.commit();
+        if (committed)
+            stats_add_bytes(0, size);
+    }
+    if (!committed)
+    {
+        if (opts.verbose)
+            std::cerr << "Failed to write " << output_path << ": " << std::strerror(errno) << std::endl;
+        return STREAM_STATUS::FAILED;
+    }
+    return STREAM_STATUS::DONE;
+}
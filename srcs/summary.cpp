@@ -1,4 +1,6 @@
 #include "resize.hpp"
+#include <iomanip>
+#include <sstream>
 
 std::string stringify_interpolation(cv::InterpolationFlags &flag)
 {
@@ -19,6 +21,40 @@ std::string stringify_interpolation(cv::InterpolationFlags &flag)
     }
 }
 
+std::string stringify_decode_scaling(DECODE_SCALING &scaling)
+{
+    switch (scaling)
+    {
+    case DECODE_SCALING::OFF:
+        return "off";
+    case DECODE_SCALING::QUALITY:
+        return "quality (keeps 2x the target size)";
+    case DECODE_SCALING::SPEED:
+        return "speed (keeps 1x the target size)";
+    default:
+        return "Unknown";
+    }
+}
+
+std::string stringify_parallelism(resize_opts &opts)
+{
+    switch (opts.parallelism)
+    {
+    case PARALLELISM::AUTO:
+    {
+        std::ostringstream threshold;
+        threshold << opts.intra_threshold / 1e6;
+        return "auto (every core from " + threshold.str() + " megapixels)";
+    }
+    case PARALLELISM::INTER:
+        return "inter (one image per core)";
+    case PARALLELISM::INTRA:
+        return "intra (every core on one image)";
+    default:
+        return "Unknown";
+    }
+}
+
 std::string stringify_method(RESIZE_METHOD &method)
 {
     switch (method)
@@ -36,6 +72,23 @@ std::string stringify_method(RESIZE_METHOD &method)
     }
 }
 
+std::string stringify_target(const target_spec &target)
+{
+    switch (target.method)
+    {
+    case RESIZE_METHOD::SCALE:
+        return "scale " + std::to_string(target.scale);
+    case RESIZE_METHOD::HEIGHT_WIDTH:
+        return std::to_string(target.width) + "x" + std::to_string(target.height);
+    case RESIZE_METHOD::HEIGHT_WIDTH_DYN:
+        return (target.width ? std::to_string(target.width) : "auto") + "x" + (target.height ? std::to_string(target.height) : "auto");
+    case RESIZE_METHOD::MIN_HEIGHT_WIDTH:
+        return "at least " + std::to_string(target.min_width) + "x" + std::to_string(target.min_height);
+    default:
+        return "Unknown";
+    }
+}
+
 void print_summary(resize_opts &opts, const std::vector<std::string> &paths)
 {
     std::cout << "Summary:" << std::endl;
@@ -47,28 +100,44 @@ void print_summary(resize_opts &opts, const std::vector<std::string> &paths)
     std::cout << "\tDry run                 : " << (opts.dry_run ? "true" : "false") << std::endl;
     std::cout << "\tDownscale interpolation : " << stringify_interpolation(opts.down_interpolation) << std::endl;
     std::cout << "\tUpscale interpolation   : " << stringify_interpolation(opts.up_interpolation) << std::endl;
-    std::cout << "\tResize method           : " << stringify_method(opts.method) << std::endl;
-    switch (opts.method)
+    std::cout << "\tDecode scaling          : " << stringify_decode_scaling(opts.decode_scaling) << std::endl;
+    if (opts.renditions.empty())
     {
-    case RESIZE_METHOD::SCALE:
-        std::cout << "\tScale factor            : " << opts.scale << std::endl;
-        break;
-    case RESIZE_METHOD::HEIGHT_WIDTH:
-        std::cout << "\tHeight                  : " << opts.height << std::endl;
-        std::cout << "\tWidth                   : " << opts.width << std::endl;
-        break;
-    case RESIZE_METHOD::HEIGHT_WIDTH_DYN:
-        std::cout << "\tHeight                  : " << (opts.height ? std::to_string(opts.height) : "auto") << std::endl;
-        std::cout << "\tWidth                   : " << (opts.width ? std::to_string(opts.width) : "auto") << std::endl;
-        break;
-    case RESIZE_METHOD::MIN_HEIGHT_WIDTH:
-        std::cout << "\tMinimal Height          : " << opts.min_height << std::endl;
-        std::cout << "\tMinimal Width           : " << opts.min_width << std::endl;
-        break;
-    default:
-        std::cout << "\tUnknown method" << std::endl;
-        break;
+        std::cout << "\tResize method           : " << stringify_method(opts.method) << std::endl;
+        switch (opts.method)
+        {
+        case RESIZE_METHOD::SCALE:
+            std::cout << "\tScale factor            : " << opts.scale << std::endl;
+            break;
+        case RESIZE_METHOD::HEIGHT_WIDTH:
+            std::cout << "\tHeight                  : " << opts.height << std::endl;
+            std::cout << "\tWidth                   : " << opts.width << std::endl;
+            break;
+        case RESIZE_METHOD::HEIGHT_WIDTH_DYN:
+            std::cout << "\tHeight                  : " << (opts.height ? std::to_string(opts.height) : "auto") << std::endl;
+            std::cout << "\tWidth                   : " << (opts.width ? std::to_string(opts.width) : "auto") << std::endl;
+            break;
+        case RESIZE_METHOD::MIN_HEIGHT_WIDTH:
+            std::cout << "\tMinimal Height          : " << opts.min_height << std::endl;
+            std::cout << "\tMinimal Width           : " << opts.min_width << std::endl;
+            break;
+        default:
+            std::cout << "\tUnknown method" << std::endl;
+            break;
+        }
+    }
+    else
+    {
+        std::cout << "\tRenditions              : " << std::endl;
+        for (auto &rendition : opts.renditions)
+            std::cout << "\t\t- " << stringify_target(rendition.target) << " (suffix " << rendition.suffix << ")" << std::endl;
     }
+    std::cout << "\tBox downscale kernel    : " << (opts.generic_resize ? "off" : box_downscale_kernel()) << std::endl;
+    std::cout << "\tCoefficient cache       : " << (opts.coef_cache ? "on" : "off") << std::endl;
+    if (opts.stream_threshold)
+        std::cout << "\tStreaming               : PNG and JPEG from " << opts.stream_threshold / 1e6 << " megapixels" << std::endl;
+    else
+        std::cout << "\tStreaming               : off" << std::endl;
     std::cout << "\tJPEG quality            : " << opts.jpeg_quality << std::endl;
     std::cout << "\tOutput format           : " << (opts.output_format.empty() ? "same as input" : opts.output_format) << std::endl;
     {
@@ -79,8 +148,71 @@ void print_summary(resize_opts &opts, const std::vector<std::string> &paths)
     }
     if (opts.keep)
         std::cout << "\tSuffix                  : " << opts.suffix << std::endl;
-    std::cout << "\tThreads                 : " << opts.threads << std::endl;
+    if (!opts.manifest.empty())
+        std::cout << "\tManifest                : " << opts.manifest << (opts.manifest_hash ? " (with content hashes)" : "") << std::endl;
+    if (!opts.stats.empty())
+        std::cout << "\tStats                   : " << ((opts.stats == "-") ? "printed" : opts.stats) << std::endl;
+    if (!opts.serve.empty())
+        std::cout << "\tServe                   : " << ((opts.serve == "-") ? "stdin" : opts.serve) << std::endl;
+    if (!opts.tar_input.empty())
+        std::cout << "\tTar input               : " << ((opts.tar_input == "-") ? "stdin" : opts.tar_input) << std::endl;
+    if (!opts.tar_output.empty())
+        std::cout << "\tTar output              : " << opts.tar_output << std::endl;
+    if (opts.shard_count > 1)
+    {
+        std::cout << "\tShard                   : " << opts.shard_index << "/" << opts.shard_count
+                  << (opts.shard_claims.empty() ? "" : " (claims in " + opts.shard_claims + ")") << std::endl;
+    }
+    if (opts.watch)
+        std::cout << "\tWatch                   : input trees" << std::endl;
+    std::cout << "\tThreads                 : " << opts.threads << (opts.pin_threads ? " (pinned)" : "") << std::endl;
+    std::cout << "\tOrder                   : " << ((opts.order == ORDER::LARGEST_FIRST) ? "largest first" : "discovery") << std::endl;
+    if (opts.memory_budget)
+        std::cout << "\tMemory budget           : " << opts.memory_budget / 1e6 << " MB" << std::endl;
+    if (!opts.pipeline)
+        std::cout << "\tParallelism             : " << stringify_parallelism(opts) << std::endl;
+    if (opts.pipeline)
+    {
+        std::cout << "\tPipeline                : " << opts.read_threads << " readers, " << opts.resize_threads << " resizers, "
+                  << opts.write_threads << " writers (queue size " << opts.queue_size << ")" << std::endl;
+    }
+    std::cout << "\tSchedule report         : " << (opts.schedule_report ? "true" : "false") << std::endl;
     std::cout << "Input paths : " << std::endl;
     for (auto &path : paths)
         std::cout << "\t- " << path << " ";
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Prints how many images each worker ran and stole, and how busy it was
+ *
+ * @param sched Scheduler the workers pulled their images from
+ * @param elapsed Wall time of the run in seconds
+ */
+void print_schedule_report(const scheduler &sched, double elapsed)
+{
+    const std::vector<worker_stats> &stats = sched.stats();
+    size_t images = 0;
+    size_t steals = 0;
+    double busy = 0.0;
+    std::ostringstream report;
+
+    report << "Scheduling report (" << sched.workers() << " workers, " << std::setprecision(3) << std::fixed << elapsed << "s):" << std::endl;
+    report << "\tWorker  Images    Steals    Busy (s)  Idle (s)  Utilization" << std::endl;
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        double utilization = (elapsed > 0.0) ? stats[i].busy * 100.0 / elapsed : 0.0;
+        report << "\t" << std::left << std::setw(8) << i
+               << std::setw(10) << stats[i].images
+               << std::setw(10) << stats[i].steals
+               << std::setw(10) << std::setprecision(3) << stats[i].busy
+               << std::setw(10) << stats[i].idle
+               << std::setprecision(1) << utilization << "%" << std::right << std::endl;
+        images += stats[i].images;
+        steals += stats[i].steals;
+        busy += stats[i].busy;
+    }
+    double average = (elapsed > 0.0 && !stats.empty()) ? busy * 100.0 / (elapsed * stats.size()) : 0.0;
+    report << "\tTotal   " << std::left << std::setw(10) << images << std::setw(10) << steals << std::setprecision(3) << busy
+           << std::right << "  (average utilization " << std::setprecision(1) << average << "%)" << std::endl;
+    std::cerr << report.str();
+}
@@ -0,0 +1,438 @@
+#include "resize.hpp"
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * ustar archives for --tar_output and --tar_input. Outputs are appended to a
+ * single archive as they are encoded, one header and the data per image,
+ * instead of creating a file each. The archive is written next to its
+ * destination and renamed over it once complete. Inputs are read from an
+ * archive sequentially, image entries are held in memory (memory_file_add)
+ * and queued under their member name, nothing is unpacked to disk.
+ */
+
+static const size_t BLOCK = 512;
+static const uint64_t MAX_NAME_HEADER = 1 << 20; // GNU long names and pax headers
+
+struct tar_header
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+static_assert(sizeof(tar_header) == BLOCK, "tar headers are one block");
+
+static std::mutex output_mtx;
+static atomic_file output;
+static bool output_active = false; // set before workers start
+static bool output_failed = false;
+static uint64_t output_entries = 0;
+static uint64_t output_bytes = 0;
+static time_t output_mtime = 0;
+
+static uint64_t padded_size(uint64_t size)
+{
+    return (size + BLOCK - 1) / BLOCK * BLOCK;
+}
+
+/**
+ * @brief Writes a number in an octal header field, NUL terminated, or in
+ * base 256 when it doesn't fit (GNU extension, for entries over 8 GB)
+ */
+static void put_number(char *field, size_t width, uint64_t value)
+{
+    if (value < (1ULL << (3 * (width - 1))))
+    {
+        std::snprintf(field, width, "%0*llo", static_cast<int>(width - 1), static_cast<unsigned long long>(value));
+        return;
+    }
+    std::memset(field, 0, width);
+    field[0] = static_cast<char>(0x80);
+    for (size_t i = width - 1; i > 0 && value; i--, value >>= 8)
+        field[i] = static_cast<char>(value & 0xff);
+}
+
+static uint64_t get_number(const char *field, size_t width)
+{
+    uint64_t value = 0;
+    if (static_cast<unsigned char>(field[0]) & 0x80)
+    {
+        for (size_t i = 1; i < width; i++)
+            value = (value << 8) | static_cast<unsigned char>(field[i]);
+        return value;
+    }
+    for (size_t i = 0; i < width && field[i]; i++)
+    {
+        if (field[i] >= '0' && field[i] <= '7')
+            value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+static unsigned int header_checksum(const tar_header &header)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&header);
+    unsigned int sum = 0;
+    for (size_t i = 0; i < BLOCK; i++)
+    {
+        bool checksum_field = i >= offsetof(tar_header, checksum) && i < offsetof(tar_header, checksum) + sizeof(header.checksum);
+        sum += checksum_field ? ' ' : bytes[i];
+    }
+    return sum;
+}
+
+static void make_header(tar_header &header, const std::string &name, uint64_t size, char typeflag)
+{
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.name, name.data(), std::min(name.size(), sizeof(header.name)));
+    put_number(header.mode, sizeof(header.mode), 0644);
+    put_number(header.uid, sizeof(header.uid), 0);
+    put_number(header.gid, sizeof(header.gid), 0);
+    put_number(header.size, sizeof(header.size), size);
+    put_number(header.mtime, sizeof(header.mtime), output_mtime);
+    header.typeflag = typeflag;
+    std::memcpy(header.magic, "ustar", 6);
+    std::memcpy(header.version, "00", 2);
+}
+
+static void seal_header(tar_header &header)
+{
+    std::snprintf(header.checksum, sizeof(header.checksum), "%06o", header_checksum(header));
+    header.checksum[7] = ' ';
+}
+
+/**
+ * @brief Builds the headers of an entry, names over 100 characters are split
+ * into the ustar prefix when they can be, else preceded by a GNU long name
+ * entry
+ *
+ * @param name Member name
+ * @param size Size of the data
+ * @param headers Filled with the blocks to write before the data
+ */
+static void entry_headers(const std::string &name, uint64_t size, std::vector<char> &headers)
+{
+    tar_header header;
+    make_header(header, name, size, '0');
+    if (name.size() > sizeof(header.name))
+    {
+        size_t slash = name.rfind('/', sizeof(header.prefix));
+        if (slash != std::string::npos && slash > 0 && name.size() - slash - 1 <= sizeof(header.name) && slash + 1 < name.size())
+        {
+            std::memset(header.name, 0, sizeof(header.name));
+            std::memcpy(header.name, name.data() + slash + 1, name.size() - slash - 1);
+            std::memcpy(header.prefix, name.data(), slash);
+        }
+        else
+        {
+            tar_header link;
+            make_header(link, "././@LongLink", name.size() + 1, 'L');
+            seal_header(link);
+            headers.insert(headers.end(), reinterpret_cast<char *>(&link), reinterpret_cast<char *>(&link) + BLOCK);
+            headers.insert(headers.end(), name.begin(), name.end());
+            headers.resize(headers.size() + padded_size(name.size() + 1) - name.size(), '\0');
+        }
+    }
+    seal_header(header);
+    headers.insert(headers.end(), reinterpret_cast<char *>(&header), reinterpret_cast<char *>(&header) + BLOCK);
+}
+
+/**
+ * @brief Creates the --tar_output archive, before any worker starts
+ *
+ * @param opts Reference to command line options
+ * @return true If the archive was created
+ */
+bool tar_output_open(const resize_opts &opts)
+{
+    if (!output.open(opts.tar_output))
+    {
+        std::cerr << "Failed to create " << opts.tar_output << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    // entries are appended under a lock, a large buffer keeps the writes sequential
+    std::setvbuf(output.stream(), nullptr, _IOFBF, 1 << 20);
+    output_mtime = std::time(nullptr);
+    output_active = true;
+    return true;
+}
+
+/**
+ * @brief Whether outputs go to a --tar_output archive instead of files
+ */
+bool tar_output_active()
+{
+    return output_active;
+}
+
+/**
+ * @brief Appends an encoded image to the archive, thread-safe
+ *
+ * @param path Output path of the image, leading slashes are dropped as tar does
+ * @param data Encoded image
+ * @return true If the entry was written, errno is set otherwise
+ */
+bool tar_write(const std::string &path, const std::vector<uchar> &data)
+{
+    size_t start = path.find_first_not_of('/');
+    std::string name = (start == std::string::npos) ? path : path.substr(start);
+    std::vector<char> headers;
+    entry_headers(name, data.size(), headers);
+    static const char zeros[BLOCK] = {};
+
+    std::lock_guard<std::mutex> lock(output_mtx);
+    if (output_failed)
+    {
+        errno = EIO;
+        return false;
+    }
+    FILE *file = output.stream();
+    size_t padding = padded_size(data.size()) - data.size();
+    if (std::fwrite(headers.data(), 1, headers.size(), file) != headers.size() ||
+        std::fwrite(data.data(), 1, data.size(), file) != data.size() ||
+        std::fwrite(zeros, 1, padding, file) != padding)
+    {
+        // a partial entry corrupts the rest of the archive
+        output_failed = true;
+        return false;
+    }
+    output_entries++;
+    output_bytes += data.size();
+    return true;
+}
+
+/**
+ * @brief Ends the archive and renames it over its destination, once every
+ * worker is done
+ *
+ * @param opts Reference to command line options
+ * @return true If the archive is complete
+ */
+bool tar_output_close(const resize_opts &opts)
+{
+    static const char zeros[2 * BLOCK] = {};
+
+    if (!output_active)
+        return true;
+    output_active = false;
+    if (output_failed || std::fwrite(zeros, 1, sizeof(zeros), output.stream()) != sizeof(zeros) || !output.commit())
+    {
+        std::cerr << "Failed to write " << opts.tar_output << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (opts.verbose)
+        std::cout << "Wrote " << output_entries << " images (" << output_bytes / 1000000 << " MB) to " << opts.tar_output << std::endl;
+    return true;
+}
+
+/**
+ * @brief Reads exactly size bytes unless the stream ends
+ *
+ * @return ssize_t Bytes read, -1 on error
+ */
+static ssize_t read_full(int fd, void *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t got = ::read(fd, static_cast<char *>(buffer) + done, size - done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return -1;
+        if (got == 0)
+            break;
+        done += got;
+    }
+    return done;
+}
+
+/**
+ * @brief Skips the data of an entry, seeking when the archive is a file
+ *
+ * @param end Size of the archive, -1 if it can't seek
+ * @return false If the archive ends first
+ */
+static bool skip_bytes(int fd, uint64_t size, off_t end)
+{
+    if (size == 0)
+        return true;
+    if (end >= 0)
+    {
+        off_t position = ::lseek(fd, size, SEEK_CUR);
+        return position != -1 && position <= end;
+    }
+    char buffer[1 << 16];
+    while (size)
+    {
+        size_t chunk = std::min<uint64_t>(size, sizeof(buffer));
+        if (read_full(fd, buffer, chunk) != static_cast<ssize_t>(chunk))
+            return false;
+        size -= chunk;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads the records of a pax extended header that matter here
+ *
+ * @param records Content of the header, "<length> <key>=<value>\n" records
+ * @param path Set to the path record, if any
+ * @param size Set to the size record, if any
+ */
+static void parse_pax(const std::string &records, std::string &path, uint64_t &size)
+{
+    size_t pos = 0;
+    while (pos < records.size())
+    {
+        size_t space = records.find(' ', pos);
+        if (space == std::string::npos)
+            return;
+        size_t length = std::strtoull(records.c_str() + pos, nullptr, 10);
+        if (length == 0 || pos + length > records.size())
+            return;
+        std::string record = records.substr(space + 1, pos + length - space - 2); // without the newline
+        size_t equal = record.find('=');
+        if (equal != std::string::npos)
+        {
+            std::string key = record.substr(0, equal);
+            if (key == "path")
+                path = record.substr(equal + 1);
+            else if (key == "size")
+                size = std::strtoull(record.c_str() + equal + 1, nullptr, 10);
+        }
+        pos += length;
+    }
+}
+
+/**
+ * @brief Streams the images of a tar archive to the callback, each one held
+ * in memory under its member name until memory_file_remove. Directories,
+ * links, entries without a valid extension and entries of other shards are
+ * skipped. ustar prefixes,
+ * GNU long names and pax paths are understood.
+ *
+ * @param options Reference to command line options
+ * @param source Path of the archive, - for stdin
+ * @param found Called with the member name of every image
+ * @return true If the whole archive was read
+ */
+bool read_tar(resize_opts &options, const std::string &source, const file_callback &found)
+{
+    int fd = (source == "-") ? STDIN_FILENO : ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open " << source << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    off_t end = (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : -1;
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::string error;
+    std::string long_name; // from a GNU long name or pax header, applies to the next entry
+    uint64_t pax_size = UINT64_MAX;
+    tar_header header;
+    while (error.empty())
+    {
+        ssize_t got = read_full(fd, &header, BLOCK);
+        if (got == 0)
+            break; // no end of archive blocks, as some writers do
+        if (got != static_cast<ssize_t>(BLOCK))
+        {
+            error = (got < 0) ? std::strerror(errno) : "truncated header";
+            break;
+        }
+        if (header.name[0] == '\0' && header_checksum(header) == 8 * ' ')
+            break; // end of archive
+        if (get_number(header.checksum, sizeof(header.checksum)) != header_checksum(header))
+        {
+            error = "not a tar archive or corrupted header";
+            break;
+        }
+
+        uint64_t size = (pax_size != UINT64_MAX) ? pax_size : get_number(header.size, sizeof(header.size));
+        uint64_t padding = padded_size(size) - size;
+        if (header.typeflag == 'L' || header.typeflag == 'x')
+        {
+            if (size > MAX_NAME_HEADER)
+            {
+                error = "corrupted header";
+                break;
+            }
+            std::string content(size, '\0');
+            if (read_full(fd, &content[0], size) != static_cast<ssize_t>(size) || !skip_bytes(fd, padding, end))
+            {
+                error = "truncated entry";
+                break;
+            }
+            if (header.typeflag == 'L')
+                long_name = content.substr(0, content.find('\0'));
+            else
+                parse_pax(content, long_name, pax_size);
+            continue;
+        }
+
+        std::string name = long_name;
+        if (name.empty())
+        {
+            name.assign(header.name, strnlen(header.name, sizeof(header.name)));
+            if (std::memcmp(header.magic, "ustar", 5) == 0 && header.prefix[0])
+                name = std::string(header.prefix, strnlen(header.prefix, sizeof(header.prefix))) + "/" + name;
+        }
+        long_name.clear();
+        pax_size = UINT64_MAX;
+
+        bool regular = header.typeflag == '0' || header.typeflag == '\0' || header.typeflag == '7';
+        if (!regular || !extension_is_valid(name, options) || !shard_owns(options, name))
+        {
+            if (!skip_bytes(fd, size + padding, end))
+                error = "truncated entry";
+            continue;
+        }
+
+        // the size comes from the header, don't allocate more than the archive can hold
+        off_t position = (end >= 0) ? ::lseek(fd, 0, SEEK_CUR) : -1;
+        if (position != -1 && size > static_cast<uint64_t>(end - position))
+        {
+            error = "truncated entry " + name;
+            break;
+        }
+        auto data = std::make_shared<std::vector<uchar>>(size);
+        if (read_full(fd, data->data(), size) != static_cast<ssize_t>(size) || !skip_bytes(fd, padding, end))
+        {
+            error = "truncated entry " + name;
+            break;
+        }
+        if (!memory_file_add(name, data))
+        {
+            std::cerr << "Warning : skipping " << name << ", the archive holds it more than once" << std::endl;
+            continue;
+        }
+        found(name);
+    }
+
+    if (fd != STDIN_FILENO)
+        ::close(fd);
+    if (!error.empty())
+        std::cerr << "Failed to read " << source << ": " << error << std::endl;
+    return error.empty();
+}
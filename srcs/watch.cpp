@@ -0,0 +1,402 @@
+#include "resize.hpp"
+#include <csignal>
+#include <cstring>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+/*
+ * --watch keeps the workers running after the initial pass and queues files
+ * as they are written into the input trees, from inotify events.
+ * Directories are watched before the initial pass starts so nothing written
+ * during it is missed. A file is queued once no event touched it for the
+ * debounce delay and its mtime is at least that old, files found in a new
+ * subdirectory settle the same way. The outputs of the run itself are not
+ * queued again: names carrying the --keep suffix or a rendition suffix are
+ * skipped, and outputs written in place are recognized by the inode, size
+ * and mtime recorded when they were renamed over their source. If the kernel
+ * drops events the inputs are walked again, queueing only the files whose
+ * inode, size or mtime differ from when the initial pass found them, the
+ * run wrote them or they were last queued; mtimes are never compared to the
+ * clock, a file moved in keeps its old one. Deleted files are forgotten from
+ * their events and at each rescan, so the record follows the tree.
+ */
+
+static const std::chrono::milliseconds debounce(100);
+static const std::chrono::seconds output_memory(60); // how long a written output is remembered
+
+typedef std::chrono::steady_clock watch_clock;
+
+struct output_id
+{
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    watch_clock::time_point written;
+    unsigned walk; // rescan that last saw the file
+};
+
+static volatile sig_atomic_t stopping = 0;
+static std::atomic<bool> active(false);
+static int inotify_fd = -1;
+static std::unordered_map<int, std::string> watched; // watch descriptor to directory
+static std::mutex outputs_mtx;
+static std::unordered_map<std::string, output_id> outputs;
+static std::unordered_map<std::string, output_id> known; // files found, queued or written while watching, as they were then
+static unsigned walks = 0;                                 // rescans so far
+
+static void on_signal(int)
+{
+    stopping = 1;
+}
+
+static int64_t realtime_ns()
+{
+    struct timespec now;
+    ::clock_gettime(CLOCK_REALTIME, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+static bool stat_id(const std::string &path, output_id &id)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+        return false;
+    id.ino = st.st_ino;
+    id.size = st.st_size;
+    id.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+/**
+ * @brief Records an output just written, so its own event isn't queued,
+ * no-op unless watching
+ *
+ * @param path Path of the output
+ */
+void watch_note_output(const std::string &path)
+{
+    output_id id;
+    if (!active || !stat_id(path, id))
+        return;
+    id.written = watch_clock::now();
+    std::lock_guard<std::mutex> lock(outputs_mtx);
+    id.walk = walks;
+    outputs[path] = id;
+    known[path] = id;
+}
+
+/**
+ * @brief Records a file found by the initial pass, so a rescan doesn't queue
+ * it again unless it changed, no-op unless watching
+ *
+ * @param path Path of the file
+ */
+void watch_note_found(const std::string &path)
+{
+    output_id id;
+    if (!active || !stat_id(path, id))
+        return;
+    std::lock_guard<std::mutex> lock(outputs_mtx);
+    id.walk = walks;
+    known[path] = id;
+}
+
+/**
+ * @brief Checks whether a file is an output of this run, left unchanged since
+ * it was written
+ */
+static bool written_by_us(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(outputs_mtx);
+    auto it = outputs.find(path);
+    if (it == outputs.end())
+        return false;
+    output_id current;
+    bool ours = stat_id(path, current) && current.ino == it->second.ino && current.size == it->second.size &&
+                current.mtime_ns == it->second.mtime_ns;
+    outputs.erase(it);
+    return ours;
+}
+
+/**
+ * @brief Checks whether a file was found, queued or written while watching,
+ * and didn't change since, marks it seen by the current rescan
+ */
+static bool already_known(const std::string &path, const output_id &id)
+{
+    std::lock_guard<std::mutex> lock(outputs_mtx);
+    auto it = known.find(path);
+    if (it == known.end())
+        return false;
+    it->second.walk = walks;
+    return it->second.ino == id.ino && it->second.size == id.size && it->second.mtime_ns == id.mtime_ns;
+}
+
+/**
+ * @brief Forgets a deleted or moved away file, or every file under a
+ * directory
+ */
+static void forget_file(const std::string &path, bool directory)
+{
+    std::lock_guard<std::mutex> lock(outputs_mtx);
+    if (!directory)
+    {
+        known.erase(path);
+        return;
+    }
+    std::string prefix = path + "/";
+    for (auto it = known.begin(); it != known.end();)
+        it = (it->first.compare(0, prefix.size(), prefix) == 0) ? known.erase(it) : std::next(it);
+}
+
+/**
+ * @brief Forgets the files the last rescan didn't see, deleted while their
+ * events were dropped
+ */
+static void forget_unseen()
+{
+    std::lock_guard<std::mutex> lock(outputs_mtx);
+    for (auto it = known.begin(); it != known.end();)
+        it = (it->second.walk != walks) ? known.erase(it) : std::next(it);
+}
+
+/**
+ * @brief Queues a file and remembers it, so a rescan doesn't queue it again
+ */
+static void queue_file(const std::string &path, const file_callback &found)
+{
+    output_id id;
+    if (stat_id(path, id))
+    {
+        std::lock_guard<std::mutex> lock(outputs_mtx);
+        id.walk = walks;
+        known[path] = id;
+    }
+    found(path);
+}
+
+static void forget_old_outputs()
+{
+    auto now = watch_clock::now();
+    std::lock_guard<std::mutex> lock(outputs_mtx);
+    for (auto it = outputs.begin(); it != outputs.end();)
+        it = (now - it->second.written > output_memory) ? outputs.erase(it) : std::next(it);
+}
+
+/**
+ * @brief Watches a directory and its subdirectories, the walk always
+ * descends into them
+ *
+ * @return false If a watch couldn't be added
+ */
+static bool add_watches(const std::string &path)
+{
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+    int wd = ::inotify_add_watch(inotify_fd, path.c_str(), mask);
+    if (wd < 0)
+    {
+        std::cerr << "Failed to watch " << path << ": " << std::strerror(errno)
+                  << ((errno == ENOSPC) ? " (raise fs.inotify.max_user_watches)" : "") << std::endl;
+        return false;
+    }
+    watched[wd] = path;
+
+    DIR *dir = ::opendir(path.c_str());
+    if (!dir)
+        return true; // removed meanwhile
+    bool success = true;
+    while (struct dirent *entry = ::readdir(dir))
+    {
+        if (entry->d_name[0] == '.' && (!entry->d_name[1] || (entry->d_name[1] == '.' && !entry->d_name[2])))
+            continue;
+        std::string child = path + "/" + entry->d_name;
+        bool directory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            directory = ::lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (directory && !add_watches(child))
+            success = false;
+    }
+    ::closedir(dir);
+    return success;
+}
+
+/**
+ * @brief Watches every input directory, before the initial pass
+ *
+ * @param inputs Input paths, files among them aren't watched
+ * @return true If at least one directory is watched
+ */
+bool watch_start(const std::vector<std::string> &inputs)
+{
+    inotify_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+    {
+        std::cerr << "Failed to start watching: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    for (auto &input : inputs)
+    {
+        if (boost::filesystem::is_directory(input))
+            add_watches(input);
+    }
+    if (watched.empty())
+    {
+        std::cerr << "Nothing to watch, watch needs at least one input directory" << std::endl;
+        ::close(inotify_fd);
+        inotify_fd = -1;
+        return false;
+    }
+    active = true;
+    return true;
+}
+
+/**
+ * @brief Queues files written into the watched directories until SIGINT or
+ * SIGTERM, the caller then drains the scheduler
+ *
+ * @param opts Reference to command line options
+ * @param inputs Input paths, walked again if the kernel dropped events
+ * @param found Called with every file to process
+ */
+void watch_run(resize_opts &opts, const std::vector<std::string> &inputs, const file_callback &found)
+{
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    ::sigaction(SIGINT, &action, nullptr);
+    ::sigaction(SIGTERM, &action, nullptr);
+
+    if (opts.verbose)
+        std::cout << "Watching " << watched.size() << " directories for new images" << std::endl;
+
+    std::unordered_map<std::string, watch_clock::time_point> settling; // path to the time it was last touched
+    alignas(struct inotify_event) char buffer[1 << 16];
+    auto last_sweep = watch_clock::now();
+    auto now = watch_clock::now();
+    // files of a new directory may still be written, they settle like the ones announced by events
+    auto settle_new = [&](const std::string &path) {
+        if (!is_output_name(opts, path))
+            settling[path] = now;
+    };
+    // a rescan only queues what the dropped events could have announced
+    auto queue_missed = [&](const std::string &path) {
+        output_id id;
+        if (!stat_id(path, id) || already_known(path, id) || is_output_name(opts, path) || settling.count(path))
+            return;
+        queue_file(path, found);
+    };
+
+    while (!stopping)
+    {
+        // wake up for the next settled file, or every so often to check for signals
+        int timeout = 500;
+        now = watch_clock::now();
+        for (auto &file : settling)
+        {
+            auto due = std::chrono::duration_cast<std::chrono::milliseconds>(file.second + debounce - now).count();
+            timeout = std::max(0, std::min(timeout, static_cast<int>(due) + 1));
+        }
+        struct pollfd pfd = {inotify_fd, POLLIN, 0};
+        if (::poll(&pfd, 1, timeout) > 0)
+        {
+            ssize_t size;
+            while ((size = ::read(inotify_fd, buffer, sizeof(buffer))) > 0)
+            {
+                now = watch_clock::now();
+                for (char *ptr = buffer; ptr < buffer + size;)
+                {
+                    struct inotify_event *event = reinterpret_cast<struct inotify_event *>(ptr);
+                    ptr += sizeof(struct inotify_event) + event->len;
+
+                    if (event->mask & IN_Q_OVERFLOW)
+                    {
+                        // events were dropped, every input is walked again for the files they announced
+                        std::cerr << "Warning : too many events at once, walking the inputs again" << std::endl;
+                        {
+                            std::lock_guard<std::mutex> lock(outputs_mtx);
+                            walks++;
+                        }
+                        duplicate_filter duplicates(inputs.size() > 1);
+                        for (auto &input : inputs)
+                        {
+                            // directories created meanwhile may have been missed too
+                            if (boost::filesystem::is_directory(input))
+                                add_watches(input);
+                            discover_files(opts, input, duplicates, queue_missed);
+                        }
+                        forget_unseen();
+                        continue;
+                    }
+                    if (event->mask & IN_IGNORED)
+                    {
+                        watched.erase(event->wd);
+                        continue;
+                    }
+                    auto dir = watched.find(event->wd);
+                    if (dir == watched.end() || !event->len)
+                        continue;
+                    std::string path = dir->second + "/" + event->name;
+
+                    if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                    {
+                        forget_file(path, event->mask & IN_ISDIR);
+                        settling.erase(path);
+                        continue;
+                    }
+                    if (event->mask & IN_ISDIR)
+                    {
+                        // files may land in a new directory before its watch is added
+                        if (add_watches(path))
+                        {
+                            duplicate_filter duplicates(false);
+                            discover_files(opts, path, duplicates, settle_new);
+                        }
+                        continue;
+                    }
+                    if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && extension_is_valid(path, opts) && !is_output_name(opts, path))
+                        settling[path] = now;
+                }
+            }
+        }
+
+        now = watch_clock::now();
+        for (auto it = settling.begin(); it != settling.end();)
+        {
+            if (now - it->second < debounce)
+            {
+                ++it;
+                continue;
+            }
+            // still being written without closing, as a file found by a walk may be
+            output_id id;
+            if (stat_id(it->first, id) && realtime_ns() - id.mtime_ns < std::chrono::duration_cast<std::chrono::nanoseconds>(debounce).count())
+            {
+                it->second = now;
+                ++it;
+                continue;
+            }
+            if (!written_by_us(it->first))
+                queue_file(it->first, found);
+            it = settling.erase(it);
+        }
+        if (now - last_sweep > output_memory)
+        {
+            forget_old_outputs();
+            last_sweep = now;
+        }
+    }
+
+    active = false;
+    ::close(inotify_fd);
+    inotify_fd = -1;
+    if (opts.verbose)
+        std::cout << "Stopped watching" << std::endl;
+}
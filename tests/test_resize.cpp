@@ -0,0 +1,141 @@
+#include "resize.hpp"
+
+/*
+ * Checks of the resize kernels that replace cv::resize, built with
+ * `make test`. The box filter must return the samples cv::resize returns
+ * for the images it accepts, and every kernel must accept the same image as
+ * source and destination.
+ */
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &name)
+{
+    std::cout << (condition ? "OK   " : "FAIL ") << name << std::endl;
+    if (!condition)
+        failures++;
+}
+
+/**
+ * @brief Fills an image with pseudo random samples, deterministic across runs
+ */
+static void fill_random(cv::Mat &image, uint32_t seed)
+{
+    size_t row_size = image.cols * image.channels();
+    for (int y = 0; y < image.rows; y++)
+    {
+        for (size_t x = 0; x < row_size; x++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            if (image.depth() == CV_16U)
+                image.ptr<uint16_t>(y)[x] = seed >> 16;
+            else
+                image.ptr<uchar>(y)[x] = seed >> 24;
+        }
+    }
+}
+
+/**
+ * @brief Counts the samples that differ between two images of the same size
+ * and type
+ */
+static size_t count_mismatches(const cv::Mat &a, const cv::Mat &b)
+{
+    if (a.size() != b.size() || a.type() != b.type())
+        return a.total() * a.channels() + 1;
+    size_t row_bytes = a.cols * a.elemSize();
+    size_t mismatches = 0;
+    for (int y = 0; y < a.rows; y++)
+    {
+        for (size_t i = 0; i < row_bytes; i++)
+            mismatches += a.ptr<uchar>(y)[i] != b.ptr<uchar>(y)[i];
+    }
+    return mismatches;
+}
+
+/**
+ * @brief box_downscale against cv::resize(INTER_AREA), for every factor,
+ * depth and channel count it accepts, with widths that exercise the SIMD
+ * tails
+ */
+static void test_box_downscale()
+{
+    const int factors[][2] = {{2, 1}, {1, 2}, {3, 3}, {4, 4}, {2, 3}, {5, 2}, {8, 8}, {16, 16}};
+
+    for (int depth : {CV_8U, CV_16U})
+    {
+        for (int cn : {1, 3, 4})
+        {
+            for (auto &factor : factors)
+            {
+                for (int width : {1, 7, 33})
+                {
+                    cv::Mat src(5 * factor[1], width * factor[0], CV_MAKETYPE(depth, cn));
+                    fill_random(src, width * 31 + factor[0] * 7 + factor[1]);
+                    // sums on the rounding edge, 8 in a 4x4 block is 0.5
+                    if (factor[0] == 4 && factor[1] == 4 && depth == CV_8U)
+                        src.ptr<uchar>(0)[0] = 8;
+
+                    cv::Mat expected, result;
+                    cv::resize(src, expected, cv::Size(width, 5), 0, 0, cv::INTER_AREA);
+                    if (!box_downscale_supported(src, width, 5))
+                        continue;
+                    box_downscale(src, result, width, 5);
+                    check(count_mismatches(expected, result) == 0,
+                          std::string("box_downscale ") + box_downscale_kernel() + " " + (depth == CV_8U ? "8u" : "16u") + " c" + std::to_string(cn) +
+                              " " + std::to_string(factor[0]) + "x" + std::to_string(factor[1]) + " width " + std::to_string(width));
+                }
+            }
+        }
+    }
+
+    cv::Mat half(8, 8, CV_8UC3);
+    check(!box_downscale_supported(half, 4, 4), "box_downscale leaves 2x2 to cv::resize");
+}
+
+/**
+ * @brief separable_resize with the same image as source and destination, as
+ * the pipeline resizes, against a resize into a separate image
+ */
+static void test_separable_in_place()
+{
+    const std::pair<cv::InterpolationFlags, const char *> interpolations[] = {
+        {cv::INTER_LINEAR, "linear"}, {cv::INTER_CUBIC, "cubic"}, {cv::INTER_LANCZOS4, "lanczos4"}, {cv::INTER_AREA, "area"}};
+    const cv::Size targets[] = {cv::Size(37, 23), cv::Size(160, 90), cv::Size(300, 200)};
+    resize_opts opts = default_options();
+    opts.coef_cache = true;
+
+    for (auto &interpolation : interpolations)
+    {
+        for (auto &target : targets)
+        {
+            cv::Mat src(120, 200, CV_8UC3);
+            fill_random(src, target.width);
+            if (!separable_resize_supported(src, target.width, target.height, interpolation.first))
+                continue;
+            std::string name = std::string("separable_resize in place ") + interpolation.second + " " + std::to_string(target.width) + "x" +
+                               std::to_string(target.height);
+
+            cv::Mat expected;
+            separable_resize(src, expected, target.width, target.height, interpolation.first);
+            cv::Mat image = src.clone();
+            separable_resize(image, image, target.width, target.height, interpolation.first);
+            check(count_mismatches(expected, image) == 0, name);
+
+            // the pipeline goes through resize_image with the same image on both sides
+            opts.down_interpolation = opts.up_interpolation = interpolation.first;
+            image = src.clone();
+            check(resize_image(opts, "in_place", image, image, target.width, target.height) && count_mismatches(expected, image) == 0,
+                  name + " through resize_image");
+        }
+    }
+}
+
+int main()
+{
+    test_box_downscale();
+    test_separable_in_place();
+    if (failures)
+        std::cout << failures << " checks failed" << std::endl;
+    return failures ? 1 : 0;
+}